@@ -17,51 +17,46 @@
  * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <util/delay.h>
 #include "adb.h"
+#include "profile.h"
+#include "stats.h"
 
-// annoying delay declaration statements, TODO figure out a better
-// way to handle these
-#ifdef HALF_SPEED
-	#define ADB_SIGDEL_ATTN_MIN 85
-	#define ADB_SIGDEL_ATTN_MAX 116
-	#define ADB_SIGDEL_SYNC_MIN 22
-	#define ADB_SIGDEL_SYNC_MAX 77
-	#define ADB_SIGDEL_SRQ_ASSERT 38
-	#define ADB_SIGDEL_SRQ_MAX 41
-	#define ADB_SIGDEL_TALK 24
-	#define ADB_SIGDEL_LISTEN1 30
-	#define ADB_SIGDEL_LISTEN2 5
-	#define ADB_SIGDEL_LISTEN_SYNC 71
-	#define ADB_SIGDEL_PULSE_SHORT 35
-	#define ADB_SIGDEL_PULSE_LONG 75
-	#define ADB_SIGDEL_BIT_SHORT 22
-	#define ADB_SIGDEL_BIT_LONG 93
-	#define ADB_SIGDEL_BIT_SPLIT 50
+// report a transaction code: always visible to the host simulator,
+// counted with USE_STATS, and written to the serial port in DEBUG_MODE
+#if defined(DEBUG_MODE) && defined(USE_ADB_EVENTS)
+	// the codes come from interrupts, so handle_adb() sends them
+	#include "fifo.h"
+	static struct fifo adb_debug_codes;
+	#define ADB_DEBUG(c) do { \
+			HAL_TRACE(c); \
+			STATS_CODE(c); \
+			fifo_put(&adb_debug_codes, c); \
+		} while (0)
+#elif defined(DEBUG_MODE)
+	#define ADB_DEBUG(c) do { \
+			HAL_TRACE(c); \
+			STATS_CODE(c); \
+			send_data(c); \
+		} while (0)
 #else
-	#define ADB_SIGDEL_ATTN_MIN 170
-	#define ADB_SIGDEL_ATTN_MAX 233
-	#define ADB_SIGDEL_SYNC_MIN 44
-	#define ADB_SIGDEL_SYNC_MAX 154
-	#define ADB_SIGDEL_SRQ_ASSERT 75
-	#define ADB_SIGDEL_SRQ_MAX 83
-	#define ADB_SIGDEL_TALK 47
-	#define ADB_SIGDEL_LISTEN1 60
-	#define ADB_SIGDEL_LISTEN2 10
-	#define ADB_SIGDEL_LISTEN_SYNC 143
-	#define ADB_SIGDEL_PULSE_SHORT 70
-	#define ADB_SIGDEL_PULSE_LONG 130
-	#define ADB_SIGDEL_BIT_SHORT 44
-	#define ADB_SIGDEL_BIT_LONG 186
-	#define ADB_SIGDEL_BIT_SPLIT 100
+	#define ADB_DEBUG(c) do { HAL_TRACE(c); STATS_CODE(c); } while (0)
 #endif
 
 // a few pin check/change things we do frequently
-#define ADB_IS_ASSERTED (!(ADB_PIN & ADB_DATA_MASK))
-#define ADB_NOT_ASSERTED (ADB_PIN & ADB_DATA_MASK)
-#define ADB_ASSERT() (ADB_DDR |= ADB_DATA_MASK)
-#define ADB_RELEASE() (ADB_DDR &= ~ADB_DATA_MASK)
+#define ADB_IS_ASSERTED (HAL_ADB_IS_ASSERTED())
+#define ADB_NOT_ASSERTED (! HAL_ADB_IS_ASSERTED())
+#define ADB_ASSERT() (HAL_ADB_ASSERT())
+#define ADB_RELEASE() (HAL_ADB_RELEASE())
 
+// device logic shared by both ADB engines
+static inline uint8_t adb_match(uint8_t);
+static void adb_respond(uint8_t, uint8_t);
+static void adb_drain(uint8_t, uint8_t);
+static void adb_listen_apply(uint8_t, uint8_t, const uint8_t *, uint8_t);
+static uint8_t adb_talk_wait(uint8_t);
+static void adb_report_recovered();
+
+#ifndef USE_ADB_EVENTS
 // branching instruction functions called from the adb handler
 static uint8_t adb_srq(uint8_t);
 static void adb_talk(uint8_t, uint8_t);
@@ -81,22 +76,70 @@ static uint8_t adb_resync(uint8_t);
 // the "standard" way to turn the timers on and off.  note that both
 // the start and stop clears the timer.  these use Timer0 and assume
 // that nothing will change timer settings from the startup defaults.
-// at 16MHz (hardcoded default) 8 is 0.5us/tick, 64 is 4us/tick
+// see hal.h for the prescale values
 static inline void start_timer_8() __attribute__((always_inline));
 static inline void start_timer_64() __attribute__((always_inline));
 static inline uint8_t stop_timer() __attribute__((always_inline));
+#endif /* ! USE_ADB_EVENTS */
 
 // some helpers for detecting problems
 static uint8_t adb_address_collision = 0;
-static uint8_t adb_protocol_error = 0;
+#ifndef USE_ADB_EVENTS
+	static uint8_t adb_protocol_error = 0;
+#endif
+
+// protocol errors worked around in the current transaction, counted
+// by adb_report_recovered() once it's clear it went through.  only
+// one of each is allowed until then, so noise can't keep us chasing
+// a transaction that isn't there
+#define ADB_RECOVER_SYNC 1 // sync out of its window
+#define ADB_RECOVER_SPIKE 2 // spike too short to be a bit skipped
+#define ADB_RECOVER_SRQ 4 // too late for the SRQ, command still served
+static uint8_t adb_recovered = 0;
+
+// state of the LFSR behind the randomized talk delay, see adb.h
+static uint16_t adb_random = 1;
 
 // buffer for storing transmitted or received information 
 static uint8_t xmit_buffer[8];
 static uint8_t xmit_len;
 
+#ifdef USE_ADB_EVENTS
+	// state machine for the event engine, see the end of this file
+	static void ev_wait(uint8_t, uint16_t, uint16_t);
+	static void ev_idle();
+	static void ev_restart();
+	static void ev_byte(uint16_t);
+	static void ev_stop(uint16_t);
+	static void ev_send();
+	static void ev_send_error(uint8_t, uint8_t);
+	static void ev_unsent();
+	static void ev_read_error();
+	static void ev_defer(uint8_t);
+	static void ev_apply();
+#endif
+
+#ifdef USE_ADB_CAPTURE
+	// line edges timestamped by Timer1 input capture, in /8 ticks,
+	// along with whether the edge asserted the line
+	#define ADB_CAPTURE_SIZE 16 // must be power of 2
+	#define ADB_CAPTURE_BITS (ADB_CAPTURE_SIZE - 1)
+	static volatile uint16_t capture_time[ADB_CAPTURE_SIZE];
+	static volatile uint8_t capture_asserted[ADB_CAPTURE_SIZE];
+	static volatile uint8_t capture_head = 0;
+	static uint8_t capture_tail = 0;
+	// the assertion that started the bit cell about to be read
+	static uint16_t capture_fall;
+	static uint8_t capture_have_fall = 0;
+	static uint8_t adb_capture_edge(uint8_t, uint16_t, uint8_t, uint16_t *);
+#endif
+
 /*
  * Overall note: the serial handler must be called about every 50-70us
- * or so to prevent data from being lost as new writes come in.
+ * or so to prevent data from being lost as new writes come in.  With
+ * USE_USART_RX_IRQ the receive interrupt takes care of that, and the
+ * calls here just need to drain the backlog promptly.  The interrupt
+ * can stretch any of the busy-wait timings below by a few us.
  * 
  * Also note that the timings are fairly sloppy, to account for the
  * AVR internal oscillator variance (+/-10%).
@@ -104,19 +147,25 @@ static uint8_t xmit_len;
 
 /// --- LOGICAL FUNCTIONS ---
 
+#ifndef USE_ADB_EVENTS
+
 void handle_adb()
 {
 	uint8_t timing;
 	uint8_t command;
 	uint8_t target;
 	
-	// new call, clear exiting information
+	// new call, clear exiting information, reporting anything the last
+	// transaction recovered from now there's time to
+	adb_report_recovered();
 	adb_protocol_error = 0;
 	xmit_len = 0;
 
-	// wait until the line does something
+	// wait until the line does something, getting talk responses
+	// ready in the meantime
 	do
 	{
+		device_stage();
 		adb_wait_for_assertion(255);
 	}
 	while (ADB_NOT_ASSERTED);
@@ -125,6 +174,17 @@ void handle_adb()
 	// attention signal, a reset signal, or something else
 	timing = adb_wait_for_line_free(ADB_SIGDEL_ATTN_MAX);
 	
+	#ifdef USE_STATS
+		// a long reset is seen here as several in a row, only count
+		// the first
+		static uint8_t resetting = 0;
+		if (timing >= ADB_SIGDEL_ATTN_MAX && ! resetting)
+		{
+			STATS_BUMP(STAT_RESETS);
+		}
+		resetting = timing >= ADB_SIGDEL_ATTN_MAX;
+	#endif
+	
 	// how long were we asserted?
 	if(timing < ADB_SIGDEL_ATTN_MIN)
 	{
@@ -139,36 +199,48 @@ void handle_adb()
 		adb_reset();
 		return;
 	}
+	adb_random = adb_stir(adb_random, timing << 8);
 	
 	// at the sync signal, so sync up with the bus to get data
 	timing = adb_resync(ADB_SIGDEL_SYNC_MAX);
-	if (timing < ADB_SIGDEL_SYNC_MIN || timing >= ADB_SIGDEL_SYNC_MAX)
+	adb_random = adb_stir(adb_random, timing);
+	if (timing >= ADB_SIGDEL_SYNC_MAX)
 	{
-		// not in correct phase of bus
-		#ifdef DEBUG_MODE
-			UDR0 = 0xE0;
-		#endif
-		return;
+		// a long sync, give the first bit a little longer to start
+		// before deciding we're not in the correct phase of bus
+		if (adb_resync(ADB_SIGDEL_SYNC_MIN) >= ADB_SIGDEL_SYNC_MIN)
+		{
+			ADB_DEBUG(0xE0);
+			return;
+		}
+		adb_recovered |= ADB_RECOVER_SYNC;
+	}
+	else if (timing < ADB_SIGDEL_SYNC_MIN)
+	{
+		// most likely a spike, which adb_read_byte() will skip the
+		// same as one within the byte
+		adb_recovered |= ADB_RECOVER_SYNC;
 	}
 	
 	// at the command byte, read it
 	command = adb_read_byte();
 	if (adb_protocol_error)
 	{
-		#ifdef DEBUG_MODE
-			UDR0 = 0xE4;
-		#endif
+		// if the sync was off, that was the real problem
+		ADB_DEBUG(adb_recovered & ADB_RECOVER_SYNC ? 0xE0 : 0xE4);
+		adb_recovered = 0;
 		return;
 	}
 
 	// at the stop byte now, we need to determine if we're 
 	// being addressed and/or if we need to issue a SRQ
+	PROFILE_BEGIN(srq_start);
 	target = adb_srq(command);
+	PROFILE_END(PROFILE_SRQ, srq_start);
 	if (adb_protocol_error)
 	{
-		#ifdef DEBUG_MODE
-			UDR0 = 0xE8;
-		#endif
+		ADB_DEBUG(0xE8);
+		adb_recovered = 0;
 		return;
 	}
 	if (! target)
@@ -196,11 +268,15 @@ void handle_adb()
 	lcmd >>= 2;
 	if (lcmd == 3)
 	{
+		PROFILE_BEGIN(talk_start);
 		adb_talk(target, command & 3);
+		PROFILE_END(PROFILE_TALK, talk_start);
 	}
 	else if (lcmd == 2)
 	{
+		PROFILE_BEGIN(listen_start);
 		adb_listen(target, command & 3);
+		PROFILE_END(PROFILE_LISTEN, listen_start);
 	}
 }
 
@@ -221,59 +297,43 @@ static uint8_t adb_srq(uint8_t command)
 	handle_data();
 	
 	// are we being addressed?
-	// also, guard here against internal address collisions: once we
-	// have a target, others should be prevented from speaking
-	uint8_t address = command >> 4;
-	uint8_t target = 0;
-	#ifdef USE_KEYBOARD
-		if (address == kbd_addr)
-		{
-			target |= ADB_KBD_FLAG_MASK;
-		}
-	#endif
-	#ifdef USE_MOUSE
-		if (target == 0 && address == mse_addr)
-		{
-			target |= ADB_MSE_FLAG_MASK;
-		}
-	#endif
-	#ifdef USE_ARBITRARY
-		if (target == 0 && address == arb_addr)
-		{
-			target |= ADB_ARB_FLAG_MASK;
-		}
-	#endif
+	uint8_t target = adb_match(command >> 4);
 	
 	// figure out what devices are asking for servicing
-	uint8_t srq = devices_needing_srq();
+	uint8_t srq = device_srq;
 	// we don't need to SRQ if we're being targeted
 	srq &= ~target;
 
 	// do we need to hold the line for SRQ?
+	uint8_t held = 0;
 	if (srq)
 	{
-		// yes.  first ensure we're still low
+		// yes, if we're still low.  if the stop bit is already over
+		// we were too late for it, but still know the command, so
+		// carry on and ask again next time
 		if (ADB_NOT_ASSERTED)
 		{
-			stop_timer();
-			adb_protocol_error = 1;
-			return 0;
+			adb_recovered |= ADB_RECOVER_SRQ;
 		}
-		
-		// then push low ourselves and hold for 300us total since
-		// start of the stop bit
-		ADB_ASSERT();
-		do
+		else
 		{
-			handle_data();
+			// push low ourselves and hold for 300us total since start
+			// of the stop bit
+			STATS_BUMP(STAT_SRQS);
+			ADB_ASSERT();
+			do
+			{
+				handle_data();
+			}
+			while (HAL_TIMER0_READ() < ADB_SIGDEL_SRQ_ASSERT);
+			ADB_RELEASE();
+			held = 1;
 		}
-		while (TCNT0 < ADB_SIGDEL_SRQ_ASSERT);
-		ADB_RELEASE();
 	}
 	
 	// make sure the line has gone high before we return, so we're
 	// in the same state regardless of SRQ issue from us
-	while (ADB_IS_ASSERTED && TCNT0 < ADB_SIGDEL_SRQ_MAX)
+	while (ADB_IS_ASSERTED && HAL_TIMER0_READ() < ADB_SIGDEL_SRQ_MAX)
 	{
 		handle_data();
 	}
@@ -283,6 +343,23 @@ static uint8_t adb_srq(uint8_t command)
 		adb_protocol_error = 2;
 		return 0;
 	}
+	if (! held && delay < ADB_SIGDEL_BIT_SHORT / 8
+			&& ! (adb_recovered & ADB_RECOVER_SPIKE))
+	{
+		// far too short for a stop bit, so a spike in the high part
+		// of the last bit.  wait for the real one and start over,
+		// which only happens once thanks to the flag
+		adb_recovered |= ADB_RECOVER_SPIKE;
+		adb_recovered &= ~ADB_RECOVER_SRQ;
+		start_timer_8();
+		while (ADB_NOT_ASSERTED && HAL_TIMER0_READ() < ADB_SIGDEL_BIT_LONG);
+		if (stop_timer() >= ADB_SIGDEL_BIT_LONG)
+		{
+			adb_protocol_error = 2;
+			return 0;
+		}
+		return adb_srq(command);
+	}
 	
 	stop_timer();
 	return target;
@@ -297,32 +374,14 @@ static void adb_talk(uint8_t target, uint8_t reg)
 	start_timer_64();
 	uint8_t i;
 	
-	#ifdef DEBUG_MODE
-		if (reg == 3)
-		{
-			UDR0 = 0xD0 + target;
-		}
-	#endif
+	if (reg == 3)
+	{
+		// the code gives the slot being talked to (D0-D7)
+		ADB_DEBUG(0xD0 + (device_lookup(target) - adb_devices));
+	}
 	
 	// construct our response
-	#ifdef USE_KEYBOARD
-		if (target & ADB_KBD_FLAG_MASK)
-		{
-			xmit_len = kbd_talk(xmit_buffer, reg);
-		}
-	#endif
-	#ifdef USE_MOUSE
-		if (target & ADB_MSE_FLAG_MASK)
-		{
-			xmit_len = mse_talk(xmit_buffer, reg);
-		}
-	#endif
-	#ifdef USE_ARBITRARY
-		if (target & ADB_ARB_FLAG_MASK)
-		{
-			xmit_len = arb_talk(xmit_buffer, reg);
-		}
-	#endif
+	adb_respond(target, reg);
 
 	// if no data will be sent, just end
 	if (xmit_len < 1)
@@ -331,10 +390,11 @@ static void adb_talk(uint8_t target, uint8_t reg)
 		return;
 	}
 	// otherwise our response handling is generic.
-	// hold until timer hits ~190us with a random variance
-	// ------------ TODO ADD A RANDOM DELAY -----------
-	uint8_t wait_ticks = ADB_SIGDEL_TALK;
-	while (ADB_NOT_ASSERTED && TCNT0 < wait_ticks)
+	// hold until timer hits ~160us, more for register 3.  the
+	// response is usually staged already, so this can sit near the
+	// 140us minimum, leaving room for the oscillator running fast
+	uint8_t wait_ticks = adb_talk_wait(reg);
+	while (ADB_NOT_ASSERTED && HAL_TIMER0_READ() < wait_ticks)
 	{
 		handle_data();
 	}
@@ -342,15 +402,14 @@ static void adb_talk(uint8_t target, uint8_t reg)
 	if (delay < wait_ticks)
 	{
 		// someone started transmitting before we could
-		#ifdef DEBUG_MODE
-			UDR0 = 0xEC;
-		#endif
+		ADB_DEBUG(0xEC);
 		if (reg == 3)
 		{
 			// ah, someone lives at our address
 			// set the collision flag for appropriate handling per the
 			// ADB spec
 			adb_address_collision |= target;
+			STATS_BUMP(STAT_COLLISIONS);
 		}
 		return;
 	}
@@ -359,13 +418,12 @@ static void adb_talk(uint8_t target, uint8_t reg)
 	adb_pulse_bit_one();
 	if (adb_protocol_error)
 	{
-		#ifdef DEBUG_MODE
-			UDR0 = (adb_protocol_error == 0xFF ? 0xED : 0xEE);
-		#endif
+		ADB_DEBUG(adb_protocol_error == 0xFF ? 0xED : 0xEE);
 		if (adb_protocol_error == 0xFF && reg == 3)
 		{
 			// as above, another collision issue
 			adb_address_collision |= target;
+			STATS_BUMP(STAT_COLLISIONS);
 		}
 		return;
 	}
@@ -374,12 +432,11 @@ static void adb_talk(uint8_t target, uint8_t reg)
 		adb_write_byte(xmit_buffer[i]);
 		if (adb_protocol_error)
 		{
-			#ifdef DEBUG_MODE
-				UDR0 = 0xEF;
-			#endif
+			ADB_DEBUG(0xEF);
 			if (adb_protocol_error == 0xFF && reg == 3)
 			{
 				adb_address_collision |= target;
+				STATS_BUMP(STAT_COLLISIONS);
 			}
 			return;
 		}
@@ -387,24 +444,7 @@ static void adb_talk(uint8_t target, uint8_t reg)
 	adb_pulse_bit_zero();
 	
 	// transmission successful, drain data that we consumed, if needed
-	#ifdef USE_KEYBOARD
-		if (target & ADB_KBD_FLAG_MASK)
-		{
-			kbd_talk_drain(reg);
-		}
-	#endif
-	#ifdef USE_MOUSE
-		if (target & ADB_MSE_FLAG_MASK)
-		{
-			mse_talk_drain(reg);
-		}
-	#endif
-	#ifdef USE_ARBITRARY
-		if (target & ADB_ARB_FLAG_MASK)
-		{
-			arb_talk_drain(reg);
-		}
-	#endif
+	adb_drain(target, reg);
 }
 
 /*
@@ -419,9 +459,7 @@ static void adb_listen(uint8_t target, uint8_t reg)
 	if (delay >= ADB_SIGDEL_LISTEN1)
 	{
 		// timeout waiting for data
-		#ifdef DEBUG_MODE
-			UDR0 = 0xDA;
-		#endif
+		ADB_DEBUG(0xDA);
 		return;
 	}
 	
@@ -429,17 +467,13 @@ static void adb_listen(uint8_t target, uint8_t reg)
 	delay = adb_wait_for_line_free(ADB_SIGDEL_LISTEN2);
 	if (delay >= ADB_SIGDEL_LISTEN2)
 	{
-		#ifdef DEBUG_MODE
-			UDR0 = 0xDB;
-		#endif
+		ADB_DEBUG(0xDB);
 		return;
 	}
 	delay = adb_resync(ADB_SIGDEL_LISTEN_SYNC);
 	if (delay >= ADB_SIGDEL_LISTEN_SYNC)
 	{
-		#ifdef DEBUG_MODE
-			UDR0 = 0xDC;
-		#endif
+		ADB_DEBUG(0xDC);
 		return;
 	}
 	
@@ -450,25 +484,115 @@ static void adb_listen(uint8_t target, uint8_t reg)
 		xmit_buffer[xmit_len++] = v;
 		v = adb_read_byte();
 	}
-	if (xmit_len < 2)
+	adb_listen_apply(target, reg, xmit_buffer, xmit_len);
+}
+
+#endif /* ! USE_ADB_EVENTS */
+
+/*
+ * Works out which of our devices, if any, lives at the given address.
+ * Returns a packed target byte per the defines.  adb_map already
+ * guards against internal address collisions.
+ */
+static inline uint8_t adb_match(uint8_t address)
+{
+	return adb_map[address];
+}
+
+#ifdef USE_ADB_EVENTS
+	// a stale copy is still sent, see the event engine
+	#define ADB_STAGED_READY(t) ((t) & ADB_STAGED_MASK)
+#else
+	#define ADB_STAGED_READY(t) ((t) & ADB_STAGED_MASK & ~device_stale)
+#endif
+
+/*
+ * Fills the transmit buffer with the given target's response to a talk
+ * of the given register, setting xmit_len (zero if there is nothing to
+ * send).
+ */
+static void adb_respond(uint8_t target, uint8_t reg)
+{
+	const struct adb_device *dev = device_lookup(target);
+	if (reg == 0 && (target & device_defer))
 	{
-		// not enough data
-		#ifdef DEBUG_MODE
-			UDR0 = 0xDD;
+		// a more urgent device is waiting, see registers.h
+		STATS_BUMP(STAT_DEFERS);
+		xmit_len = 0;
+	}
+	#ifdef USE_ADB_EVENTS
+	else if (reg == 0 && (target & (device_sending | device_staging)))
+	{
+		// the last reply hasn't been drained yet, so this would
+		// repeat it, or the copy is being rebuilt
+		xmit_len = 0;
+	}
+	#endif
+	else if (reg == 0 && ADB_STAGED_READY(target))
+	{
+		// already built ahead of time, see device_stage()
+		uint8_t slot = dev - adb_devices;
+		uint8_t i;
+		xmit_len = device_staged_len[slot];
+		for (i = 0; i < xmit_len; i++)
+		{
+			xmit_buffer[i] = device_staged[slot][i];
+		}
+		#ifdef USE_ADB_EVENTS
+			// left alone until its drain, see device_sending
+			if (xmit_len) device_sending |= target;
 		#endif
+	}
+	else
+	{
+		xmit_len = dev->talk(dev->inst, xmit_buffer, reg);
+	}
+}
+
+/*
+ * Called after a response made by adb_respond() has been sent in full,
+ * to drain the data it consumed.
+ */
+static void adb_drain(uint8_t target, uint8_t reg)
+{
+	const struct adb_device *dev = device_lookup(target);
+	STATS_BUMP(STAT_TALKS);
+	dev->drain(dev->inst, reg);
+	if (reg == 0)
+	{
+		// the copy that went out is used up
+		device_staged_len[dev - adb_devices] = 0;
+		device_serviced(target);
+		device_sending &= ~target;
+	}
+	device_changed(target);
+}
+
+/*
+ * Called with the data bytes of a listen once they have all been read,
+ * to hand them to the given target.
+ */
+static void adb_listen_apply(uint8_t target, uint8_t reg,
+		const uint8_t *data, uint8_t len)
+{
+	const struct adb_device *dev = device_lookup(target);
+	
+	if (len < 2)
+	{
+		// not enough data
+		ADB_DEBUG(0xDD);
 		return;
 	}
+	STATS_BUMP(STAT_LISTENS);
 	
 	// if register 3, stuff gets weird, so handle that case within
 	// the actual ADB handler
 	if (reg == 3)
 	{
-		#ifdef DEBUG_MODE
-			UDR0 = 0xDE;
-		#endif
+		ADB_DEBUG(0xDE);
 		
-		uint8_t naddr = xmit_buffer[0] & 15;
-		uint8_t nhandler = xmit_buffer[1];
+		uint8_t naddr = data[0] & 15;
+		uint8_t nhandler = data[1];
 		
 		// we don't support self-testing
 		if (nhandler == 0xFF) return;
@@ -485,59 +609,81 @@ static void adb_listen(uint8_t target, uint8_t reg)
 		if (naddr < 0x01 || naddr > 0x0F) return;
 		
 		// regardless of remaining codes, update
-		#ifdef USE_KEYBOARD
-			if (target & ADB_KBD_FLAG_MASK)
-			{
-				kbd_addr = naddr;
-				// support changing to handlers 2 or 3 only
-				if (nhandler == 2 || nhandler == 3)
-				{
-					kbd_handler = nhandler;
-				}
-			}
-		#endif
-		#ifdef USE_MOUSE
-			else if (target & ADB_MSE_FLAG_MASK)
-			{
-				mse_addr = naddr;
-			}
-		#endif
-		#ifdef USE_ARBITRARY
-			else if (target & ADB_ARB_FLAG_MASK)
-			{
-				arb_addr = naddr;
-			}
-		#endif
+		*dev->addr = naddr;
+		if (nhandler < 8 && (dev->handlers & (1 << nhandler)))
+		{
+			*dev->handler = nhandler;
+		}
+		device_map_update();
+		device_changed(target);
 	}
 	else
 	{
-		#ifdef DEBUG_MODE
-			UDR0 = 0xDF;
-		#endif
+		ADB_DEBUG(0xDF);
 		
-		uint16_t data = (xmit_buffer[0] << 8) + xmit_buffer[1];
-		#ifdef USE_KEYBOARD
-			if (target & ADB_KBD_FLAG_MASK)
-			{
-				kbd_listen(reg, data);
-			}
-		#endif
-		#ifdef USE_MOUSE
-			// does not listen to anything at this point
-			//if (target & ADB_MSE_FLAG_MASK)
-			//{
-			//	mse_listen(reg, data);
-			//}
-		#endif
-		#ifdef USE_ARBITRARY
-			if (target & ADB_ARB_FLAG_MASK)
-			{
-				arb_listen(reg, data);
-			}
-		#endif
+		if (dev->listen)
+		{
+			dev->listen(dev->inst, reg, data, len);
+			device_changed(target);
+		}
 	}
 }
 
+/*
+ * Gives how long to wait in Tlt before replying to a talk of the given
+ * register, in /64 ticks.  Only register 3 is randomized, since that
+ * is where other devices may share our address; everything else gets
+ * the quickest reply.
+ */
+static uint8_t adb_talk_wait(uint8_t reg)
+{
+	if (reg != 3) return ADB_SIGDEL_TALK;
+	adb_random = adb_lfsr(adb_random);
+	return ADB_TALK_DELAY(adb_random);
+}
+
+/*
+ * Reports the recoveries made during a transaction that went through,
+ * each under its error code less 0x20, and clears them.
+ */
+static void adb_report_recovered()
+{
+	if (! adb_recovered) return;
+	if (adb_recovered & ADB_RECOVER_SYNC) ADB_DEBUG(0xC0);
+	if (adb_recovered & ADB_RECOVER_SPIKE) ADB_DEBUG(0xC4);
+	if (adb_recovered & ADB_RECOVER_SRQ) ADB_DEBUG(0xC8);
+	adb_recovered = 0;
+}
+
+/*
+ * Called once on MCU startup, before the first adb_reset(), to set up
+ * the line and any timer hardware the ADB code needs.
+ */
+void adb_init()
+{
+	// ensure that the ADB pin will go low when the direction is changed
+	HAL_ADB_INIT();
+	
+	#ifdef USE_ADB_CAPTURE
+		// Timer1 runs free from here on, timestamping every edge
+		HAL_CAPTURE_INIT();
+		HAL_IRQ_ENABLE();
+	#endif
+	#ifdef USE_ADB_EVENTS
+		// and here it times everything, with the line waking us up
+		HAL_TIMER1_FREE_RUN();
+		HAL_PINCHANGE_INIT();
+		HAL_IRQ_ENABLE();
+	#endif
+	#if (defined(USE_MOUSE_SHAPING) || defined(PROFILE) \
+			|| defined(USE_FRAMED)) \
+			&& !defined(USE_ADB_CAPTURE) && !defined(USE_ADB_EVENTS)
+		// otherwise only the mouse, profiling and the framed protocol
+		// need it, as a clock
+		HAL_TIMER1_FREE_RUN();
+	#endif
+}
+
 /*
  * Called immediately after the ADB bus reset condition, and upon MCU
  * startup.  This will set all address and handler values back to their
@@ -546,25 +692,16 @@ static void adb_listen(uint8_t target, uint8_t reg)
 void adb_reset()
 {
 	// note reception of reset signal
-	#ifdef DEBUG_MODE
-		UDR0 = 0xFF;
-	#endif
+	ADB_DEBUG(0xFF);
 	
 	// ---reset addresses---
-	#ifdef USE_KEYBOARD
-		kbd_addr = 2;
-		kbd_handler = 2;
-	#endif
-	
-	#ifdef USE_MOUSE
-		mse_addr = 3;
-		mse_handler = mse_init_handler;
-	#endif
-	
-	#ifdef USE_ARBITRARY
-		arb_addr = arb_init_addr;
-		arb_handler = arb_init_handler;
-	#endif
+	uint8_t i;
+	for (i = 0; i < ADB_DEVICES; i++)
+	{
+		*adb_devices[i].addr = *adb_devices[i].init_addr;
+		*adb_devices[i].handler = *adb_devices[i].init_handler;
+	}
+	device_map_update();
 	
 	// ---reset registers---
 	reset_registers();
@@ -573,6 +710,8 @@ void adb_reset()
 
 /// --- UTILITY METHODS ---
 
+#ifndef USE_ADB_EVENTS
+
 /*
  * Reads a byte from the line.  This aborts if it detects a timing flaw
  * and sets the protocol error flag appropriately.  If there is no
@@ -581,23 +720,113 @@ void adb_reset()
  * 
  * Return value is the read byte.  Ignore the return value if errored.
  */
+#ifdef USE_ADB_CAPTURE
+/*
+ * This version works from the edges timestamped by input capture, so
+ * the measured bit times don't depend on how long handle_data() took
+ * or when the loop noticed the edge, and the CPU only has to keep up
+ * with the edge queue.  The timing limits are the same.
+ */
+uint8_t adb_read_byte()
+{
+	uint16_t rise;
+	uint8_t low;
+	uint8_t value = 0;
+	uint8_t i;
+	
+	// the first cell starts at the assertion adb_resync() stopped
+	// at, later ones where the previous byte's last cell ended
+	if (! capture_have_fall)
+	{
+		if (! adb_capture_edge(1, capture_fall, 0xFF, &capture_fall))
+		{
+			adb_protocol_error = 1;
+			return 0;
+		}
+		capture_have_fall = 1;
+	}
+	
+	i = 0;
+	while (i < 8)
+	{
+		// time the line spent low
+		if (! adb_capture_edge(0, capture_fall,
+				ADB_SIGDEL_BIT_LONG, &rise))
+		{
+			adb_protocol_error = 1;
+			return 0;
+		}
+		low = rise - capture_fall;
+		if (low < ADB_SIGDEL_BIT_SHORT
+				&& ! (adb_recovered & ADB_RECOVER_SPIKE))
+		{
+			// a spike rather than a bit, the cell starts at the next
+			// assertion; see the other version
+			adb_recovered |= ADB_RECOVER_SPIKE;
+			if (! adb_capture_edge(1, rise, ADB_SIGDEL_BIT_LONG,
+					&capture_fall))
+			{
+				adb_protocol_error = 2;
+				return 0;
+			}
+			continue;
+		}
+		else if (low < ADB_SIGDEL_BIT_SHORT)
+		{
+			adb_protocol_error = 1;
+			return 0;
+		}
+		
+		// (ADB talks in MSB->LSB order)
+		value <<= 1;
+		if (low < ADB_SIGDEL_BIT_SPLIT) value |= 1;
+		
+		// and the line must assert again for the next bit in time
+		if (! adb_capture_edge(1, rise, ADB_SIGDEL_BIT_LONG, &capture_fall))
+		{
+			adb_protocol_error = 2;
+			return 0;
+		}
+		i++;
+	}
+	
+	return value;
+}
+#else
 uint8_t adb_read_byte()
 {
 	uint8_t delay = 0;
 	uint8_t value = 0;
 	uint8_t i = 0;
 
-	for (i = 0; i < 8; i++)
+	while (i < 8)
 	{
 		start_timer_8();
 		handle_data();
 		
 		// wait while the line is low, with timeout
-		while (ADB_IS_ASSERTED && TCNT0 < ADB_SIGDEL_BIT_LONG);
+		while (ADB_IS_ASSERTED && HAL_TIMER0_READ() < ADB_SIGDEL_BIT_LONG);
 		
 		// get the time value we waited, halting the timer, with
 		// a check that the transmission was within specs
 		delay = stop_timer();
+		if (delay < ADB_SIGDEL_BIT_SHORT
+				&& ! (adb_recovered & ADB_RECOVER_SPIKE))
+		{
+			// far too short for a bit, so a spike during the high
+			// part of the last cell (or the sync).  wait out the
+			// rest of that and read this bit again
+			adb_recovered |= ADB_RECOVER_SPIKE;
+			start_timer_8();
+			while (ADB_NOT_ASSERTED
+					&& HAL_TIMER0_READ() < ADB_SIGDEL_BIT_LONG);
+			if (stop_timer() >= ADB_SIGDEL_BIT_LONG)
+			{
+				adb_protocol_error = 2;
+				return 0;
+			}
+			continue;
+		}
 		if (delay < ADB_SIGDEL_BIT_SHORT
 			|| delay >= ADB_SIGDEL_BIT_LONG)
 		{
@@ -616,7 +845,7 @@ uint8_t adb_read_byte()
 		
 		// wait for the line to assert again for the
 		// next bit in line (with generic timeout)
-		while (ADB_NOT_ASSERTED && TCNT0 < ADB_SIGDEL_BIT_LONG);
+		while (ADB_NOT_ASSERTED && HAL_TIMER0_READ() < ADB_SIGDEL_BIT_LONG);
 		
 		// verify that the delay wasn't wild
 		delay = stop_timer();
@@ -625,10 +854,12 @@ uint8_t adb_read_byte()
 			adb_protocol_error = 2;
 			return 0;
 		}
+		i++;
 	}
 
 	return value;
 }
+#endif /* USE_ADB_CAPTURE */
 
 /*
  * Writes a byte to the line.  Aborts if it detects a timing flaw or a
@@ -682,7 +913,7 @@ static void adb_pulse_bit(uint8_t low, uint8_t high)
 	ADB_ASSERT();
 	start_timer_8();
 	handle_data(); // usual check, done in <20us
-	while (TCNT0 < low);
+	while (HAL_TIMER0_READ() < low);
 	ADB_RELEASE();
 	stop_timer();
 	
@@ -691,7 +922,7 @@ static void adb_pulse_bit(uint8_t low, uint8_t high)
 	handle_data();  // usual check, done in <20us
 	
 	// watch that line remains unasserted during up time
-	while (ADB_NOT_ASSERTED && TCNT0 < high);
+	while (ADB_NOT_ASSERTED && HAL_TIMER0_READ() < high);
 	delay = stop_timer();
 	if (delay < high)
 	{
@@ -716,7 +947,7 @@ static void adb_pulse_bit(uint8_t low, uint8_t high)
 uint8_t adb_wait_for_assertion(uint8_t timeout)
 {
 	start_timer_64();
-	while (ADB_NOT_ASSERTED && TCNT0 < timeout)
+	while (ADB_NOT_ASSERTED && HAL_TIMER0_READ() < timeout)
 	{
 		handle_data();
 	}
@@ -729,7 +960,7 @@ uint8_t adb_wait_for_assertion(uint8_t timeout)
 uint8_t adb_wait_for_line_free(uint8_t timeout)
 {
 	start_timer_64();
-	while (ADB_IS_ASSERTED && TCNT0 < timeout)
+	while (ADB_IS_ASSERTED && HAL_TIMER0_READ() < timeout)
 	{
 		handle_data();
 	}
@@ -745,30 +976,731 @@ uint8_t adb_wait_for_line_free(uint8_t timeout)
  */
 uint8_t adb_resync(uint8_t timeout)
 {
+	#ifdef USE_ADB_CAPTURE
+		// the line is free, so the next edge queued starts the first
+		// bit cell adb_read_byte() will want; it can't be older than
+		// right now
+		capture_tail = capture_head;
+		capture_have_fall = 0;
+		capture_fall = HAL_TIMER1_READ();
+	#endif
 	start_timer_8();
 	handle_data();
-	while (ADB_NOT_ASSERTED && TCNT0 < timeout);
+	while (ADB_NOT_ASSERTED && HAL_TIMER0_READ() < timeout);
 	return stop_timer();
 }
 
+#ifdef USE_ADB_CAPTURE
+/*
+ * Takes the next captured edge, waiting for it and servicing the
+ * serial port in the meantime.  Given the kind of edge expected, the
+ * Timer1 value to measure from, and the timeout in /8 ticks.  Returns
+ * zero if no edge arrives before the timeout, or if the edge is the
+ * wrong kind or too late; otherwise the edge time is stored.
+ */
+static uint8_t adb_capture_edge(uint8_t asserted, uint16_t from,
+		uint8_t timeout, uint16_t *time)
+{
+	while (capture_tail == capture_head)
+	{
+		if ((uint16_t) (HAL_TIMER1_READ() - from) >= timeout) return 0;
+		handle_data();
+	}
+	
+	uint8_t tail = capture_tail;
+	*time = capture_time[tail];
+	capture_tail = (tail + 1) & ADB_CAPTURE_BITS;
+	return capture_asserted[tail] == asserted
+			&& (uint16_t) (*time - from) < timeout;
+}
+
+/*
+ * Records each edge on the line.  The edge select is flipped after
+ * each capture so both directions are seen; if the queue is full the
+ * edge is dropped, which adb_capture_edge() will notice.
+ */
+HAL_ISR(TIMER1_CAPT)
+{
+	uint8_t head = capture_head;
+	uint8_t next = (head + 1) & ADB_CAPTURE_BITS;
+	capture_time[head] = HAL_CAPTURE_TIME();
+	capture_asserted[head] = HAL_CAPTURE_FALLING();
+	HAL_CAPTURE_FLIP();
+	if (next != capture_tail)
+	{
+		capture_head = next;
+	}
+}
+#endif /* USE_ADB_CAPTURE */
+
 // --- timer helper methods ---
 
 static inline void start_timer_8()
 {
-	TCNT0 = 0x00;
-	TCCR0B = 0x02;
+	HAL_TIMER0_START(HAL_TIMER0_DIV8);
 }
 
 static inline void start_timer_64()
 {
-	TCNT0 = 0x00;
-	TCCR0B = 0x03;
+	HAL_TIMER0_START(HAL_TIMER0_DIV64);
 }
 
 static inline uint8_t stop_timer()
 {
-	uint8_t delay = TCNT0;
-	TCCR0B = 0x00;
-	TCNT0 = 0x00;
+	uint8_t delay = HAL_TIMER0_READ();
+	HAL_TIMER0_HALT();
 	return delay;
 }
+
+#endif /* ! USE_ADB_EVENTS */
+
+
+/// --- EVENT ENGINE ---
+
+#ifdef USE_ADB_EVENTS
+
+/*
+ * Alternative to the busy-waiting code above, selected with
+ * USE_ADB_EVENTS.  The same transaction is run as a state machine out
+ * of two interrupts: a pin change on the ADB line, and Timer1 compare
+ * match A.  Timer1 runs free at /8, the same 0.5us ticks the /8
+ * signal delays use (the /64 ones are scaled up by EV_64()), so edges
+ * are timestamped as they're seen and every timeout is a compare
+ * match.  Nothing waits on the line, and handle_adb() only has to
+ * service the serial port, leaving the rest of the CPU to the main
+ * loop.
+ * 
+ * Outgoing pulses are timed by compare matches too.  The output
+ * compare pins can't drive an open-drain line, so the interrupt flips
+ * the direction bit; each edge is scheduled from the compare time of
+ * the previous one rather than from when the interrupt ran, so the
+ * latency doesn't add up over a reply.
+ * 
+ * Device state belongs to the main loop, so interrupts don't have to
+ * be held off while handle_data() changes it, which would make the
+ * edges seen meanwhile look late.  The interrupts only read it, and
+ * never wait on the main loop to reply:
+ * 
+ * - Register 0 replies are the copies device_stage() makes, which it
+ *   keeps up to date between and during transactions.  One that is
+ *   stale is sent all the same; it is an older report, and its drain
+ *   takes off exactly what it held.  The only device not answered is
+ *   the one whose copy is being rebuilt, for as long as that takes,
+ *   and the host just asks again.
+ * - Talks to registers 1-3 only read a few bytes, and are built in
+ *   the interrupt.  Changes to those that take more than one write
+ *   are made with interrupts held off.
+ * 
+ * Anything that changes state (drains, listens, flushes, resets) is
+ * queued by ev_defer(), with its own copy of any listen data, for
+ * handle_adb() to make in order, with interrupts held off.  A device
+ * whose copy went out stays in device_sending until its drain is made,
+ * so the copy is neither rebuilt nor sent again before the drain takes
+ * off what it held, and the drain then empties it.
+ */
+
+// convert a /64 signal delay into Timer1 ticks
+#define EV_64(d) ((uint16_t) (d) * 8)
+
+// engine states, named for what is being waited on
+#define EV_IDLE 0 // any assertion
+#define EV_ATTENTION 1 // end of attention, or a reset
+#define EV_RESET 2 // end of reset
+#define EV_SYNC 3 // end of sync
+#define EV_BIT_LOW 4 // release in a received bit
+#define EV_BIT_HIGH 5 // assertion starting the next cell
+#define EV_SRQ 6 // end of our SRQ
+#define EV_STOP 7 // end of the stop bit
+#define EV_TALK 8 // end of Tlt before we reply
+#define EV_SEND_LOW 9 // end of an asserted part of a sent bit
+#define EV_SEND_HIGH 10 // end of a sent bit
+#define EV_LISTEN 11 // start of the listen start bit
+#define EV_LISTEN_START 12 // end of the listen start bit low
+#define EV_LISTEN_SYNC 13 // end of the listen start bit
+
+static uint8_t ev_state = EV_IDLE;
+// the time the current state is measured from, and when it times out
+static uint16_t ev_edge;
+static uint16_t ev_due;
+// the transaction so far
+static uint8_t ev_command;
+static uint8_t ev_target;
+static uint8_t ev_reg;
+static uint8_t ev_listening;
+// bits received into the current byte, or sent in the reply
+static uint8_t ev_value;
+static uint8_t ev_bits;
+// changes left for the main loop, oldest at ev_deferred_tail.  only
+// the interrupts move the head and only the main loop the tail, as in
+// fifo.h.  there are far more than the main loop needs, since each
+// transaction takes milliseconds
+#define EV_DEFER_DRAIN 1
+#define EV_DEFER_LISTEN 2
+#define EV_DEFER_FLUSH 3
+#define EV_DEFER_RESET 4
+#define EV_DEFER_SIZE 4 // must be power of 2
+#define EV_DEFER_BITS (EV_DEFER_SIZE - 1)
+struct ev_change
+{
+	uint8_t what;
+	uint8_t target;
+	uint8_t reg;
+	uint8_t len;
+	uint8_t data[8];
+};
+static struct ev_change ev_deferred[EV_DEFER_SIZE];
+static volatile uint8_t ev_deferred_head = 0;
+static volatile uint8_t ev_deferred_tail = 0;
+#define EV_DEFERRED (ev_deferred_head != ev_deferred_tail)
+
+void handle_adb()
+{
+	// the interrupts do all the bus work, leaving device state to us
+	ev_apply();
+	handle_data();
+	device_stage();
+	
+	#ifdef DEBUG_MODE
+		while (! fifo_empty(&adb_debug_codes))
+		{
+			send_data(fifo_get(&adb_debug_codes));
+		}
+	#endif
+	
+	// only one response is staged each time around, so don't sleep
+	// while there are more to do
+	if (! EV_DEFERRED
+			&& ! (device_stale & ADB_STAGED_MASK & ~device_sending))
+	{
+		HAL_IDLE();
+	}
+}
+
+/*
+ * Handles every change on the line.  Our own changes are seen too,
+ * and are ignored by the states that make them.
+ */
+HAL_ISR(ADB_PCINT)
+{
+	uint16_t now = HAL_TIMER1_READ();
+	uint8_t asserted = ADB_IS_ASSERTED;
+	
+	switch (ev_state)
+	{
+		case EV_IDLE:
+			if (asserted)
+			{
+				ev_wait(EV_ATTENTION, now, EV_64(ADB_SIGDEL_ATTN_MAX));
+			}
+			break;
+		case EV_ATTENTION:
+			if (! asserted)
+			{
+				uint16_t low = now - ev_edge;
+				if (low < EV_64(ADB_SIGDEL_ATTN_MIN))
+				{
+					// too short to be attention, which is common
+					ev_idle();
+				}
+				else
+				{
+					adb_random = adb_stir(adb_random, low << 8);
+					adb_recovered = 0;
+					ev_wait(EV_SYNC, now, ADB_SIGDEL_SYNC_MAX);
+				}
+			}
+			break;
+		case EV_RESET:
+			if (! asserted) ev_idle();
+			break;
+		case EV_SYNC:
+			if (asserted)
+			{
+				uint16_t high = now - ev_edge;
+				adb_random = adb_stir(adb_random, high);
+				if (high < ADB_SIGDEL_SYNC_MIN
+						&& (adb_recovered & ADB_RECOVER_SYNC))
+				{
+					// not in correct phase of bus
+					ADB_DEBUG(0xE0);
+					ev_restart();
+				}
+				else
+				{
+					// a short sync is most likely a spike, which
+					// EV_BIT_LOW skips the same as one in the byte
+					if (high < ADB_SIGDEL_SYNC_MIN)
+					{
+						adb_recovered |= ADB_RECOVER_SYNC;
+					}
+					ev_listening = 0;
+					ev_value = 0;
+					ev_bits = 0;
+					ev_wait(EV_BIT_LOW, now, ADB_SIGDEL_BIT_LONG);
+				}
+			}
+			break;
+		case EV_BIT_LOW:
+			if (! asserted)
+			{
+				uint16_t low = now - ev_edge;
+				if (low < ADB_SIGDEL_BIT_SHORT
+						&& ! (adb_recovered & ADB_RECOVER_SPIKE))
+				{
+					// a spike rather than a bit, so the cell really
+					// starts at the next assertion
+					adb_recovered |= ADB_RECOVER_SPIKE;
+					ev_wait(EV_BIT_HIGH, now, ADB_SIGDEL_BIT_LONG);
+				}
+				else if (low < ADB_SIGDEL_BIT_SHORT)
+				{
+					ev_read_error();
+				}
+				else
+				{
+					// (ADB talks in MSB->LSB order)
+					ev_value <<= 1;
+					if (low < ADB_SIGDEL_BIT_SPLIT) ev_value |= 1;
+					ev_bits++;
+					ev_wait(EV_BIT_HIGH, now, ADB_SIGDEL_BIT_LONG);
+				}
+			}
+			break;
+		case EV_BIT_HIGH:
+			if (asserted)
+			{
+				if (ev_bits == 8)
+				{
+					ev_byte(now);
+				}
+				else
+				{
+					ev_wait(EV_BIT_LOW, now, ADB_SIGDEL_BIT_LONG);
+				}
+			}
+			break;
+		case EV_STOP:
+			if (! asserted)
+			{
+				if ((uint16_t) (now - ev_edge) < ADB_SIGDEL_BIT_SHORT
+						&& ! (adb_recovered & ADB_RECOVER_SPIKE))
+				{
+					// far too short for a stop bit, so a spike in
+					// the high part of the last bit; the real one
+					// is still to come
+					adb_recovered |= ADB_RECOVER_SPIKE;
+					ev_wait(EV_BIT_HIGH, now, ADB_SIGDEL_BIT_LONG);
+				}
+				else
+				{
+					ev_stop(now);
+				}
+			}
+			break;
+		case EV_TALK:
+			if (asserted)
+			{
+				// someone started transmitting before we could
+				ADB_DEBUG(0xEC);
+				ev_unsent();
+				if (ev_reg == 3)
+				{
+					// ah, someone lives at our address
+					adb_address_collision |= ev_target;
+					STATS_BUMP(STAT_COLLISIONS);
+				}
+				ev_idle();
+			}
+			break;
+		case EV_SEND_HIGH:
+			if (asserted)
+			{
+				// collision
+				ev_send_error(ev_bits == 1 ? 0xED : 0xEF, 1);
+			}
+			break;
+		case EV_LISTEN:
+			if (asserted)
+			{
+				ev_wait(EV_LISTEN_START, now, EV_64(ADB_SIGDEL_LISTEN2));
+			}
+			break;
+		case EV_LISTEN_START:
+			if (! asserted)
+			{
+				ev_wait(EV_LISTEN_SYNC, now, ADB_SIGDEL_LISTEN_SYNC);
+			}
+			break;
+		case EV_LISTEN_SYNC:
+			if (asserted)
+			{
+				ev_listening = 1;
+				ev_value = 0;
+				ev_bits = 0;
+				ev_wait(EV_BIT_LOW, now, ADB_SIGDEL_BIT_LONG);
+			}
+			break;
+	}
+}
+
+/*
+ * Handles every timeout, and times the edges we make.
+ */
+HAL_ISR(TIMER1_COMPA)
+{
+	switch (ev_state)
+	{
+		case EV_ATTENTION:
+			// held past attention, reset and wait for the release
+			STATS_BUMP(STAT_RESETS);
+			ev_defer(EV_DEFER_RESET);
+			ev_state = EV_RESET;
+			HAL_COMPARE_OFF();
+			break;
+		case EV_SYNC:
+			if (! (adb_recovered & ADB_RECOVER_SYNC))
+			{
+				// a long sync, give the first bit a little longer to
+				// start before deciding we're not in phase
+				adb_recovered |= ADB_RECOVER_SYNC;
+				ev_wait(EV_SYNC, ev_edge,
+						ADB_SIGDEL_SYNC_MAX + ADB_SIGDEL_SYNC_MIN);
+			}
+			else
+			{
+				ADB_DEBUG(0xE0);
+				ev_restart();
+			}
+			break;
+		case EV_BIT_LOW:
+		case EV_BIT_HIGH:
+			ev_read_error();
+			break;
+		case EV_SRQ:
+			// held for long enough since the start of the stop bit
+			ADB_RELEASE();
+			ev_wait(EV_STOP, ev_edge, EV_64(ADB_SIGDEL_SRQ_MAX));
+			break;
+		case EV_STOP:
+			ADB_DEBUG(0xE8);
+			ev_restart();
+			break;
+		case EV_TALK:
+			ev_bits = 0;
+			ev_send();
+			break;
+		case EV_SEND_LOW:
+			ADB_RELEASE();
+			ev_wait(EV_SEND_HIGH, ev_due, ev_value
+					? ADB_SIGDEL_PULSE_LONG : ADB_SIGDEL_PULSE_SHORT);
+			break;
+		case EV_SEND_HIGH:
+			ev_send();
+			break;
+		case EV_LISTEN:
+			// timeout waiting for data
+			ADB_DEBUG(0xDA);
+			ev_restart();
+			break;
+		case EV_LISTEN_START:
+			ADB_DEBUG(0xDB);
+			ev_restart();
+			break;
+		case EV_LISTEN_SYNC:
+			ADB_DEBUG(0xDC);
+			ev_restart();
+			break;
+		default:
+			HAL_COMPARE_OFF();
+			break;
+	}
+}
+
+/*
+ * Moves to the given state, measured from the given time, with a
+ * timeout the given number of ticks after that.
+ */
+static void ev_wait(uint8_t state, uint16_t from, uint16_t ticks)
+{
+	ev_state = state;
+	ev_edge = from;
+	ev_due = from + ticks;
+	HAL_COMPARE_SET(ev_due);
+}
+
+static void ev_idle()
+{
+	ev_state = EV_IDLE;
+	HAL_COMPARE_OFF();
+}
+
+/*
+ * Drops the current transaction.  If the line is down, that might be
+ * the start of the next attention, so it's timed as one.
+ */
+static void ev_restart()
+{
+	if (ADB_IS_ASSERTED)
+	{
+		ev_wait(EV_ATTENTION, HAL_TIMER1_READ(),
+				EV_64(ADB_SIGDEL_ATTN_MAX));
+	}
+	else
+	{
+		ev_idle();
+	}
+}
+
+/*
+ * Called with a full byte in ev_value, as the line asserts to start
+ * the next bit cell.  For a command that's the stop bit, which is
+ * where we'd hold the line for a SRQ.
+ */
+static void ev_byte(uint16_t now)
+{
+	if (ev_listening)
+	{
+		xmit_buffer[xmit_len++] = ev_value;
+		if (xmit_len < 8)
+		{
+			ev_value = 0;
+			ev_bits = 0;
+			ev_wait(EV_BIT_LOW, now, ADB_SIGDEL_BIT_LONG);
+		}
+		else
+		{
+			ev_defer(EV_DEFER_LISTEN);
+			adb_report_recovered();
+			ev_restart();
+		}
+		return;
+	}
+	
+	// the command made it, so anything recovered from so far worked;
+	// a listen can still skip a spike of its own
+	adb_report_recovered();
+	PROFILE_BEGIN(t);
+	ev_command = ev_value;
+	ev_target = adb_match(ev_command >> 4);
+	
+	// we don't need to SRQ if we're being targeted
+	uint8_t srq = device_srq & ~ev_target;
+	PROFILE_END(PROFILE_SRQ, t);
+	if (srq)
+	{
+		// hold for 300us total since the start of the stop bit
+		STATS_BUMP(STAT_SRQS);
+		ADB_ASSERT();
+		ev_wait(EV_SRQ, now, EV_64(ADB_SIGDEL_SRQ_ASSERT));
+	}
+	else
+	{
+		ev_wait(EV_STOP, now, EV_64(ADB_SIGDEL_SRQ_MAX));
+	}
+}
+
+/*
+ * Called when the line is released after the command stop bit, at the
+ * start of Tlt.  See handle_adb() in the polled engine for the command
+ * decoding.
+ */
+static void ev_stop(uint16_t now)
+{
+	if (! ev_target)
+	{
+		// not being talked to, so ignore rest of transaction
+		ev_idle();
+		return;
+	}
+	
+	xmit_len = 0;
+	ev_reg = ev_command & 3;
+	uint8_t lcmd = ev_command & 15;
+	if (lcmd == 1)
+	{
+		ev_defer(EV_DEFER_FLUSH);
+	}
+	lcmd >>= 2;
+	if (lcmd == 3)
+	{
+		if (ev_reg == 3)
+		{
+			ADB_DEBUG(0xD0 + (device_lookup(ev_target) - adb_devices));
+		}
+		PROFILE_BEGIN(t);
+		adb_respond(ev_target, ev_reg);
+		PROFILE_END(PROFILE_TALK, t);
+		if (xmit_len < 1)
+		{
+			ev_idle();
+			return;
+		}
+		ev_wait(EV_TALK, now, EV_64(adb_talk_wait(ev_reg)));
+	}
+	else if (lcmd == 2)
+	{
+		ev_wait(EV_LISTEN, now, EV_64(ADB_SIGDEL_LISTEN1));
+	}
+	else
+	{
+		ev_idle();
+	}
+}
+
+/*
+ * Starts the next bit of a reply at the time the last one was due to
+ * end: the "1" start bit, the data, then the "0" stop bit.  Once the
+ * stop bit is done, the data that was sent is drained.
+ */
+static void ev_send()
+{
+	if (ev_bits == xmit_len * 8 + 2)
+	{
+		// transmission successful
+		ev_defer(EV_DEFER_DRAIN);
+		ev_idle();
+		return;
+	}
+	
+	// check that the line isn't being used by someone else
+	if (ADB_IS_ASSERTED)
+	{
+		ev_send_error(ev_bits == 0 ? 0xEE : 0xEF, 0);
+		return;
+	}
+	
+	uint8_t i = ev_bits++;
+	if (i == 0)
+	{
+		ev_value = 1;
+	}
+	else if (--i < xmit_len * 8)
+	{
+		ev_value = (xmit_buffer[i >> 3] << (i & 7)) & 0x80;
+	}
+	else
+	{
+		ev_value = 0;
+	}
+	
+	ADB_ASSERT();
+	ev_wait(EV_SEND_LOW, ev_due, ev_value
+			? ADB_SIGDEL_PULSE_SHORT : ADB_SIGDEL_PULSE_LONG);
+}
+
+/*
+ * Gives up on a reply, with the code to report and whether it was
+ * because someone else was talking over us.
+ */
+static void ev_send_error(uint8_t code, uint8_t collision)
+{
+	ADB_DEBUG(code);
+	ev_unsent();
+	if (collision && ev_reg == 3)
+	{
+		// as in the polled engine, per the ADB spec
+		adb_address_collision |= ev_target;
+		STATS_BUMP(STAT_COLLISIONS);
+	}
+	ev_idle();
+}
+
+/*
+ * Called when a reply is given up on, so a register 0 copy that didn't
+ * go out can be built again and sent later.
+ */
+static void ev_unsent()
+{
+	if (ev_reg == 0) device_sending &= ~ev_target;
+}
+
+/*
+ * Called when a received bit is out of spec.  During a listen that's
+ * the normal end of the data, after the host's stop bit.
+ */
+static void ev_read_error()
+{
+	if (ev_listening)
+	{
+		ev_defer(EV_DEFER_LISTEN);
+		adb_report_recovered();
+	}
+	else
+	{
+		// if the sync was off, that was the real problem
+		ADB_DEBUG(adb_recovered & ADB_RECOVER_SYNC ? 0xE0 : 0xE4);
+		adb_recovered = 0;
+	}
+	ev_restart();
+}
+
+/*
+ * Leaves a change to device state for the main loop, for the current
+ * transaction's target and register.  A listen's data is copied out of
+ * xmit_buffer, which the next transaction reuses.  If the main loop
+ * has somehow fallen that far behind, the change is lost.
+ */
+static void ev_defer(uint8_t what)
+{
+	uint8_t head = ev_deferred_head;
+	uint8_t next = (head + 1) & EV_DEFER_BITS;
+	if (next == ev_deferred_tail)
+	{
+		// without its drain, a reply is better sent twice than
+		// never again
+		if (what == EV_DEFER_DRAIN) ev_unsent();
+		return;
+	}
+	
+	struct ev_change *c = &ev_deferred[head];
+	uint8_t i;
+	c->what = what;
+	c->target = ev_target;
+	c->reg = ev_reg;
+	c->len = xmit_len;
+	if (what == EV_DEFER_LISTEN)
+	{
+		for (i = 0; i < xmit_len; i++)
+		{
+			c->data[i] = xmit_buffer[i];
+		}
+	}
+	ev_deferred_head = next;
+}
+
+/*
+ * Makes the changes left by the interrupts, oldest first.  Each is
+ * made with interrupts held off, so a talk never sees one partway.
+ */
+static void ev_apply()
+{
+	while (EV_DEFERRED)
+	{
+		uint8_t tail = ev_deferred_tail;
+		struct ev_change *c = &ev_deferred[tail];
+		uint8_t sreg = HAL_IRQ_SAVE();
+		switch (c->what)
+		{
+			case EV_DEFER_DRAIN:
+				adb_drain(c->target, c->reg);
+				break;
+			case EV_DEFER_LISTEN:
+			{
+				PROFILE_BEGIN(t);
+				adb_listen_apply(c->target, c->reg, c->data, c->len);
+				PROFILE_END(PROFILE_LISTEN, t);
+				break;
+			}
+			case EV_DEFER_FLUSH:
+				device_flush(c->target);
+				break;
+			case EV_DEFER_RESET:
+				adb_reset();
+				break;
+		}
+		HAL_IRQ_RESTORE(sreg);
+		ev_deferred_tail = (tail + 1) & EV_DEFER_BITS;
+	}
+}
+
+#endif /* USE_ADB_EVENTS */
@@ -19,9 +19,72 @@
 
 #pragma once
 
-#include <avr/io.h>
-#include "config.h"
+#include "hal.h"
 #include "data.h"
 
+// ADB signal timing, in Timer0 ticks at the prescale the relevant wait
+// uses (see adb.c).  these are here so the host simulator can check
+// bus timing margins against them.  TODO figure out a better way to
+// handle these
+#ifdef HALF_SPEED
+	#define ADB_SIGDEL_ATTN_MIN 85
+	#define ADB_SIGDEL_ATTN_MAX 116
+	#define ADB_SIGDEL_SYNC_MIN 22
+	#define ADB_SIGDEL_SYNC_MAX 77
+	#define ADB_SIGDEL_SRQ_ASSERT 38
+	#define ADB_SIGDEL_SRQ_MAX 41
+	#define ADB_SIGDEL_TALK 20
+	#define ADB_SIGDEL_TALK_SPREAD 8
+	#define ADB_SIGDEL_LISTEN1 30
+	#define ADB_SIGDEL_LISTEN2 5
+	#define ADB_SIGDEL_LISTEN_SYNC 71
+	#define ADB_SIGDEL_PULSE_SHORT 35
+	#define ADB_SIGDEL_PULSE_LONG 75
+	#define ADB_SIGDEL_BIT_SHORT 22
+	#define ADB_SIGDEL_BIT_LONG 93
+	#define ADB_SIGDEL_BIT_SPLIT 50
+#else
+	#define ADB_SIGDEL_ATTN_MIN 170
+	#define ADB_SIGDEL_ATTN_MAX 233
+	#define ADB_SIGDEL_SYNC_MIN 44
+	#define ADB_SIGDEL_SYNC_MAX 154
+	#define ADB_SIGDEL_SRQ_ASSERT 75
+	#define ADB_SIGDEL_SRQ_MAX 83
+	#define ADB_SIGDEL_TALK 40
+	#define ADB_SIGDEL_TALK_SPREAD 16
+	#define ADB_SIGDEL_LISTEN1 60
+	#define ADB_SIGDEL_LISTEN2 10
+	#define ADB_SIGDEL_LISTEN_SYNC 143
+	#define ADB_SIGDEL_PULSE_SHORT 70
+	#define ADB_SIGDEL_PULSE_LONG 130
+	#define ADB_SIGDEL_BIT_SHORT 44
+	#define ADB_SIGDEL_BIT_LONG 186
+	#define ADB_SIGDEL_BIT_SPLIT 100
+#endif
+
+/*
+ * Replies to register 3 talks wait a random extra part of
+ * ADB_SIGDEL_TALK_SPREAD (a power of 2) in Tlt, so that several of us
+ * at one address don't all start at once and can see each other,
+ * per the collision handling in the ADB spec.  The random numbers come
+ * from a 16 bit Galois LFSR, stirred with the measured lengths of each
+ * attention and sync so that units with slightly different clocks
+ * drift apart.
+ * These are here so the simulator can model collisions (see sim.c).
+ */
+#define ADB_TALK_DELAY(r) \
+		(ADB_SIGDEL_TALK + ((r) & (ADB_SIGDEL_TALK_SPREAD - 1)))
+static inline uint16_t adb_lfsr(uint16_t r)
+{
+	return (r >> 1) ^ (-(r & 1) & 0xB400);
+}
+static inline uint16_t adb_stir(uint16_t r, uint16_t v)
+{
+	r ^= v;
+	// zero would stop the LFSR for good
+	return r ? r : 1;
+}
+
+void adb_init();
 void handle_adb();
 void adb_reset();
@@ -0,0 +1,65 @@
+# Turns the test.c output from a simulated run into a benchmark report,
+# see "make bench".  The timed sweeps follow the "0A" header: "00" lines
+# are handle_serial_data() for each input byte, "02" lines the byte
+# that finishes a command taking more than one, "01" lines are the high
+# nibble of each keycode, and the last field is the time in cycles.
+#
+# Prints one "suite input cycles" line per measurement, then the worst
+# case for each suite, and exits nonzero if anything went over budget
+# (in cycles) or nothing was measured at all.
+
+function hex(s,    i, v)
+{
+	v = 0
+	for (i = 1; i <= length(s); i++)
+	{
+		v = v * 16 + index("0123456789ABCDEF", toupper(substr(s, i, 1))) - 1
+	}
+	return v
+}
+
+{
+	# simavr colours the UART output
+	gsub(/\033\[[0-9;]*m/, "")
+	gsub(/\r/, "")
+}
+
+NF == 1 && length($1) == 2 {
+	timing = ($1 == "0A")
+	next
+}
+
+timing && NF == 3 && ($1 == "00" || $1 == "01" || $1 == "02") {
+	if ($1 == "00") suite = "serial"
+	else if ($1 == "01") suite = "keyboard"
+	else suite = "finish"
+	cycles = hex($3)
+	printf "%s 0x%s %d%s\n", suite, $2, cycles, \
+			(cycles > budget) ? " OVER" : ""
+	count++
+	if (cycles > worst[suite])
+	{
+		worst[suite] = cycles
+		worst_input[suite] = $2
+	}
+	if (cycles > budget) over++
+}
+
+END {
+	for (suite in worst)
+	{
+		printf "worst %s 0x%s %d budget %d\n", suite, worst_input[suite], \
+				worst[suite], budget
+	}
+	if (! count)
+	{
+		print "no timing data, did the simulator run?" > "/dev/stderr"
+		exit 2
+	}
+	if (over)
+	{
+		printf "%d command(s) over the %d cycle budget\n", over, budget \
+				> "/dev/stderr"
+		exit 1
+	}
+}
@@ -19,10 +19,16 @@
 
 #pragma once
 
-#include <avr/io.h>
+#ifdef HOST_BUILD
+	#include "hal_host.h"
+#else
+	#include <avr/io.h>
+#endif
 
 // define the ADB data port used by the controller
-#ifdef ADB_PORTA
+#ifdef HOST_BUILD
+	// the line is simulated in hal_host.c, no port needed
+#elif ADB_PORTA
 	#define ADB_PORT PORTA
 	#define ADB_DDR DDRA
 	#define ADB_PIN PINA
@@ -30,14 +36,23 @@
 	#define ADB_PORT PORTB
 	#define ADB_DDR DDRB
 	#define ADB_PIN PINB
+	#define ADB_PCMSK PCMSK0
+	#define ADB_PCIE PCIE0
+	#define ADB_PCINT_vect PCINT0_vect
 #elif ADB_PORTC
 	#define ADB_PORT PORTC
 	#define ADB_DDR DDRC
 	#define ADB_PIN PINC
+	#define ADB_PCMSK PCMSK1
+	#define ADB_PCIE PCIE1
+	#define ADB_PCINT_vect PCINT1_vect
 #elif ADB_PORTD
 	#define ADB_PORT PORTD
 	#define ADB_DDR DDRD
 	#define ADB_PIN PIND
+	#define ADB_PCMSK PCMSK2
+	#define ADB_PCIE PCIE2
+	#define ADB_PCINT_vect PCINT2_vect
 #else
 	#error "You must define an ADB_PORT"
 #endif
@@ -56,5 +71,56 @@
 	#error "You must define ADB_DATA_PIN to a 8 bit port"
 #endif
 
+// input capture decoding needs the line on the ICP1 pin
+#if defined(USE_ADB_CAPTURE) && ! defined(HOST_BUILD)
+	#if ! (defined(ADB_PORTB) && ADB_DATA_PIN == 0)
+		#error "USE_ADB_CAPTURE requires the ADB line on ICP1 (PB0)"
+	#endif
+#endif
+
+// the event engine needs a pin change interrupt on the line, and owns
+// Timer1 in a way input capture can't share
+#ifdef USE_ADB_EVENTS
+	#ifdef USE_ADB_CAPTURE
+		#error "USE_ADB_EVENTS and USE_ADB_CAPTURE cannot be used together"
+	#endif
+	#if ! defined(HOST_BUILD) && ! defined(ADB_PCMSK)
+		#error "USE_ADB_EVENTS needs the ADB line on a pin change port"
+	#endif
+#endif
+
+// the mouse scheduler is part of the mouse
+#if defined(USE_MOUSE_SHAPING) && ! defined(USE_MOUSE)
+	#error "USE_MOUSE_SHAPING requires USE_MOUSE"
+#endif
+
+// how many keyboards and mice to emulate, each its own device on the
+// bus, see registers.h
+#ifndef KBD_COUNT
+	#define KBD_COUNT 1
+#endif
+#ifndef MSE_COUNT
+	#define MSE_COUNT 1
+#endif
+#if KBD_COUNT < 1 || KBD_COUNT > 4 || MSE_COUNT < 1 || MSE_COUNT > 4
+	#error "KBD_COUNT and MSE_COUNT must be from 1 to 4"
+#endif
+
+// service request priority class of each type of device, lower being
+// more urgent, and how many times others may be serviced ahead of a
+// waiting device before it is no longer held back; see registers.h
+#ifndef KBD_SRQ_CLASS
+	#define KBD_SRQ_CLASS 0
+#endif
+#ifndef MSE_SRQ_CLASS
+	#define MSE_SRQ_CLASS 1
+#endif
+#ifndef ARB_SRQ_CLASS
+	#define ARB_SRQ_CLASS 2
+#endif
+#ifndef SRQ_STARVE_LIMIT
+	#define SRQ_STARVE_LIMIT 4
+#endif
+
 #define ADB_DATA_BIT ADB_DATA_PIN
 #define ADB_DATA_MASK _BV(ADB_DATA_PIN)
@@ -19,7 +19,7 @@
 
 #pragma once
 
-#include <avr/io.h>
+#include "hal.h"
 #include "registers.h"
 
 /*
@@ -43,7 +43,14 @@ void init_data();
  * 2) This cannot take very much time to execute.  Most of the ADB
  * handling code assumes a maximum execution time of about 20us.
  * If you're doing complicated stuff... uh, be careful.  The standard
- * system has test code and has been profiled to never take more than
- * about 10us or so. 
+ * system has test code to profile it with, see serial.h.
  */
 void handle_data();
+
+/*
+ * Queues a byte to go back to the host outside of the normal reply to
+ * a command, such as the DEBUG_MODE codes or multi-byte replies.  With
+ * USE_USART_TX_IRQ this never blocks; otherwise it waits for the
+ * transmitter to take the previous byte.
+ */
+void send_data(uint8_t);
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Defines a small single-producer, single-consumer byte FIFO for
+ * passing data between an interrupt handler and the main loop.
+ * 
+ * Only the producer writes the head and only the consumer writes the
+ * tail.  Both are single bytes, so reads and writes of them are atomic
+ * on the AVR and no locking is needed, as long as there is exactly one
+ * producer and one consumer per FIFO.  One slot is always left empty to
+ * tell a full FIFO from an empty one.  The data is volatile too, so the
+ * compiler can't move a slot's write after the head that publishes it,
+ * or its read after the tail that frees it.
+ */
+
+#pragma once
+
+#include "hal.h"
+
+#define FIFO_SIZE 32 // must be power of 2
+#define FIFO_BITS (FIFO_SIZE - 1)
+
+struct fifo
+{
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	volatile uint8_t data[FIFO_SIZE];
+};
+
+/*
+ * Producer side: adds a value, returning zero if the FIFO was full and
+ * the value was dropped.
+ */
+static inline uint8_t fifo_put(struct fifo *f, uint8_t v)
+{
+	uint8_t head = f->head;
+	uint8_t next = (head + 1) & FIFO_BITS;
+	if (next == f->tail) return 0;
+	f->data[head] = v;
+	f->head = next;
+	return 1;
+}
+
+/*
+ * Consumer side: removes the oldest value.  Only call this when the
+ * FIFO is not empty.
+ */
+static inline uint8_t fifo_get(struct fifo *f)
+{
+	uint8_t tail = f->tail;
+	uint8_t v = f->data[tail];
+	f->tail = (tail + 1) & FIFO_BITS;
+	return v;
+}
+
+static inline uint8_t fifo_empty(struct fifo *f)
+{
+	return f->head == f->tail;
+}
+
+static inline uint8_t fifo_count(struct fifo *f)
+{
+	return (f->head - f->tail) & FIFO_BITS;
+}
+
+/*
+ * Consumer side: drops everything currently queued.
+ */
+static inline void fifo_clear(struct fifo *f)
+{
+	f->tail = f->head;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hardware abstraction layer.  Everything in the firmware that touches
+ * the ADB pin, the timers, or the serial hardware goes through the
+ * macros in this file.
+ * 
+ * On the AVR these expand directly to the register operations they
+ * replace, so there is no runtime cost.  When HOST_BUILD is defined
+ * they are instead routed to hal_host.c, which simulates the pin,
+ * timer, and USART state in virtual time so the same sources can be
+ * run and tested on a workstation (see "make host").
+ */
+
+#pragma once
+
+#include "config.h"
+
+// Timer0 clock select values, shared by both implementations.
+// at 16MHz (hardcoded default) 8 is 0.5us/tick, 64 is 4us/tick
+#define HAL_TIMER0_DIV8 0x02
+#define HAL_TIMER0_DIV64 0x03
+
+#ifndef HOST_BUILD
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+
+#ifdef USE_USART
+	#ifndef BAUD
+		#define BAUD 38400
+	#endif
+	#include <util/setbaud.h>
+#endif
+
+// --- interrupts ---
+#define HAL_ISR(v) ISR(v##_vect)
+#define HAL_IRQ_ENABLE() sei()
+#define HAL_IRQ_DISABLE() cli()
+// holds interrupts off around a short section, putting them back as
+// they were after, so these can nest
+#define HAL_IRQ_SAVE() hal_irq_save()
+#define HAL_IRQ_RESTORE(s) (SREG = (s))
+static inline uint8_t hal_irq_save()
+{
+	uint8_t sreg = SREG;
+	cli();
+	return sreg;
+}
+// keeps the compiler from moving memory accesses across this point
+#define HAL_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+// stops until reset; simulators such as simavr end the run here
+#define HAL_HALT() do { cli(); sleep_enable(); sleep_cpu(); } while (1)
+
+// --- ADB line ---
+// the line is open-drain: the port bit is held low and the direction
+// bit is toggled to assert or release the line
+#define HAL_ADB_INIT() (ADB_PORT &= ~ADB_DATA_MASK)
+#define HAL_ADB_IS_ASSERTED() (!(ADB_PIN & ADB_DATA_MASK))
+#define HAL_ADB_ASSERT() (ADB_DDR |= ADB_DATA_MASK)
+#define HAL_ADB_RELEASE() (ADB_DDR &= ~ADB_DATA_MASK)
+
+// --- Timer0, used for all ADB signal timing ---
+#define HAL_TIMER0_START(cs) do { TCNT0 = 0x00; TCCR0B = (cs); } while (0)
+#define HAL_TIMER0_READ() (TCNT0)
+#define HAL_TIMER0_HALT() do { TCCR0B = 0x00; TCNT0 = 0x00; } while (0)
+
+// --- Timer1, used for profiling at prescale /1 ---
+#define HAL_TIMER1_START() (TCCR1B = 0x01)
+#define HAL_TIMER1_HALT() (TCCR1B = 0x00)
+#define HAL_TIMER1_READ() (hal_timer1_read())
+#define HAL_TIMER1_CLEAR() (TCNT1 = 0)
+
+/*
+ * 16 bit timer reads share the TEMP register with every other 16 bit
+ * access, so one in an interrupt (like ICR1 below) can corrupt a read
+ * here.  Keep interrupts off for the two byte read.
+ */
+static inline uint16_t hal_timer1_read()
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t t = TCNT1;
+	SREG = sreg;
+	return t;
+}
+
+// --- Timer1 input capture on ICP1, free running at /8 ---
+// the capture interrupt flips the edge select after each edge
+#define HAL_CAPTURE_INIT() do { \
+		TCCR1A = 0x00; \
+		TCCR1B = _BV(CS11); \
+		TIFR1 = _BV(ICF1); \
+		TIMSK1 |= _BV(ICIE1); \
+	} while (0)
+#define HAL_CAPTURE_TIME() (ICR1)
+#define HAL_CAPTURE_FALLING() (! (TCCR1B & _BV(ICES1)))
+#define HAL_CAPTURE_FLIP() do { \
+		TCCR1B ^= _BV(ICES1); \
+		TIFR1 = _BV(ICF1); \
+	} while (0)
+
+// --- Timer1 free running at /8, with the compare A interrupt ---
+#define HAL_TIMER1_FREE_RUN() do { \
+		TCCR1A = 0x00; \
+		TCCR1B = _BV(CS11); \
+	} while (0)
+#define HAL_COMPARE_SET(t) do { \
+		OCR1A = (t); \
+		TIFR1 = _BV(OCF1A); \
+		TIMSK1 |= _BV(OCIE1A); \
+	} while (0)
+#define HAL_COMPARE_OFF() (TIMSK1 &= ~_BV(OCIE1A))
+
+// --- pin change interrupt on the ADB line, vector ADB_PCINT ---
+#define HAL_PINCHANGE_INIT() do { \
+		ADB_PCMSK |= ADB_DATA_MASK; \
+		PCIFR = _BV(ADB_PCIE); \
+		PCICR |= _BV(ADB_PCIE); \
+	} while (0)
+
+// --- main loop with nothing to do ---
+#define HAL_IDLE() ((void) 0)
+
+// --- USART ---
+#if USE_2X
+	#define HAL_USART_2X() (UCSR0A |= _BV(U2X0))
+#else
+	#define HAL_USART_2X() (UCSR0A &= ~_BV(U2X0))
+#endif
+#define HAL_USART_INIT() do { \
+		UBRR0H = UBRRH_VALUE; \
+		UBRR0L = UBRRL_VALUE; \
+		HAL_USART_2X(); \
+		UCSR0B = _BV(RXEN0) | _BV(TXEN0); \
+	} while (0)
+#define HAL_USART_RX_IRQ_ENABLE() (UCSR0B |= _BV(RXCIE0))
+#define HAL_USART_RX_READY() (UCSR0A & _BV(RXC0))
+#define HAL_USART_READ() (UDR0)
+#define HAL_USART_TX_IRQ_ENABLE() (UCSR0B |= _BV(UDRIE0))
+#define HAL_USART_TX_IRQ_DISABLE() (UCSR0B &= ~_BV(UDRIE0))
+#define HAL_USART_TX_READY() (UCSR0A & _BV(UDRE0))
+#define HAL_USART_WRITE(v) (UDR0 = (v))
+
+// --- tracing, only used by the host simulator ---
+#define HAL_TRACE(c) ((void) 0)
+
+// --- constant tables, kept in flash rather than copied to RAM ---
+#define HAL_FLASH PROGMEM
+#define HAL_FLASH_BYTE(p) pgm_read_byte(p)
+#define HAL_FLASH_FUNC(type, p) ((type) pgm_read_word(p))
+
+// --- USI in SPI mode ---
+#define HAL_SPI_INIT() (USICR |= _BV(USIWM0) | _BV(USICS1))
+#define HAL_SPI_RX_READY() (USISR & _BV(USIOIF))
+#define HAL_SPI_READ() (USIBR)
+#define HAL_SPI_ACK() (USISR |= _BV(USIOIF))
+#define HAL_SPI_WRITE(v) (USIDR = (v))
+
+#endif /* ! HOST_BUILD */
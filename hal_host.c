@@ -0,0 +1,663 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <setjmp.h>
+#include <time.h>
+#include "hal.h"
+
+#define HOST_USART_BUFFER_SIZE 256 // must be power of 2
+#define HOST_USART_BUFFER_BITS (HOST_USART_BUFFER_SIZE - 1)
+// the AVR USART receive FIFO depth
+#define HOST_USART_HW_FIFO 2
+// virtual cycles per byte on the wire, 8N1
+#define HOST_USART_BYTE_CYCLES ((uint64_t) F_CPU * 10 / BAUD)
+
+// interrupt handlers, if the firmware declares them with HAL_ISR()
+void hal_host_isr_USART_RX() __attribute__((weak));
+void hal_host_isr_USART_UDRE() __attribute__((weak));
+void hal_host_isr_TIMER1_CAPT() __attribute__((weak));
+void hal_host_isr_TIMER1_COMPA() __attribute__((weak));
+void hal_host_isr_ADB_PCINT() __attribute__((weak));
+
+static uint8_t master_idle(uint64_t);
+static uint8_t master_script(uint64_t);
+static void tick();
+static void service_usart();
+static void service_timer1();
+static void service_pinchange();
+static uint8_t line_level();
+
+uint64_t hal_host_cycles = 0;
+uint8_t (*hal_host_master)(uint64_t) = master_idle;
+void (*hal_host_device_hook)(uint64_t, uint8_t) = 0;
+void (*hal_host_trace_hook)(uint8_t) = 0;
+void (*hal_host_usart_sink)(uint8_t) = 0;
+uint32_t hal_host_usart_overruns = 0;
+uint32_t hal_host_usart_overwrites = 0;
+
+// line state
+static uint8_t device_asserting = 0;
+static const struct hal_host_pulse *script = 0;
+static uint16_t script_len = 0;
+static uint64_t script_start = 0;
+
+// run control
+static jmp_buf run_env;
+static uint8_t run_active = 0;
+static uint64_t run_deadline = 0;
+
+// interrupt state
+static uint8_t irq_enabled = 0;
+static uint8_t irq_active = 0;
+
+// timers
+static uint64_t timer0_start = 0;
+static uint8_t timer0_div = 0;
+static uint64_t timer1_count = 0;
+static uint64_t timer1_start_ns = 0;
+static uint8_t timer1_running = 0;
+
+// Timer1 in virtual time, see hal_host_timer1_free_run()
+static uint8_t timer1_virtual = 0;
+static uint64_t timer1_origin = 0;
+static uint8_t compare_enabled = 0;
+static uint8_t compare_flag = 0;
+static uint64_t compare_at = 0;
+
+// input capture, see hal_host_capture_init()
+static uint8_t capture_enabled = 0;
+static uint8_t capture_line = 0;
+static uint8_t capture_rising = 0;
+static uint8_t capture_flag = 0;
+static uint16_t capture_icr = 0;
+
+// pin change interrupt on the line
+static uint8_t pinchange_enabled = 0;
+static uint8_t pinchange_line = 0;
+static uint8_t pinchange_flag = 0;
+
+// USART buffers, for data going to and from the firmware.  the
+// receive side is split into bytes still on the wire and the ones
+// that have arrived in the hardware FIFO
+static uint8_t rx_data[HOST_USART_BUFFER_SIZE];
+static uint8_t rx_head = 0;
+static uint8_t rx_tail = 0;
+static uint64_t rx_next_arrival = 0;
+static uint8_t rx_hw_data[HOST_USART_HW_FIFO];
+static uint8_t rx_hw_count = 0;
+static uint8_t rx_irq_enabled = 0;
+static uint8_t tx_data[HOST_USART_BUFFER_SIZE];
+static uint8_t tx_head = 0;
+static uint8_t tx_tail = 0;
+static uint64_t tx_shift_end = 0;
+static uint8_t tx_udr = 0;
+static uint8_t tx_udr_full = 0;
+static uint8_t tx_irq_enabled = 0;
+
+
+// --- simulation control ---
+
+/*
+ * Repeatedly calls the given function (normally handle_adb()) until
+ * the given number of virtual cycles has elapsed.  The firmware is
+ * stopped wherever it happens to be when time runs out, so callers
+ * should leave the bus idle near the deadline.
+ */
+uint8_t hal_host_run(void (*fn)(void), uint64_t cycles)
+{
+	run_deadline = hal_host_cycles + cycles;
+	run_active = 1;
+	irq_active = 0;
+	if (! setjmp(run_env))
+	{
+		while (1)
+		{
+			fn();
+		}
+	}
+	run_active = 0;
+	return 1;
+}
+
+/*
+ * Stops a hal_host_run() in progress.  This can only be called from
+ * code running inside the run, such as a bus master or hook.
+ */
+void hal_host_halt()
+{
+	if (run_active)
+	{
+		longjmp(run_env, 1);
+	}
+}
+
+/*
+ * Replaces the bus master with one that plays back the given pulses,
+ * starting at the current virtual time.  The line is released once
+ * the script ends.  The script must outlive the playback.
+ */
+void hal_host_line_script(const struct hal_host_pulse *pulses,
+		uint16_t len)
+{
+	script = pulses;
+	script_len = len;
+	script_start = hal_host_cycles;
+	hal_host_master = master_script;
+}
+
+uint8_t hal_host_device_asserting()
+{
+	return device_asserting;
+}
+
+/*
+ * Sends a byte to the USART.  It arrives one byte time after the
+ * previous one finished, or after now if the wire is idle.  Bytes
+ * beyond what the wire queue can hold are discarded.
+ */
+void hal_host_usart_push(uint8_t v)
+{
+	if (((rx_head + 1) & HOST_USART_BUFFER_BITS) != rx_tail)
+	{
+		uint64_t arrival = hal_host_cycles + HOST_USART_BYTE_CYCLES;
+		if (rx_head == rx_tail && rx_next_arrival < arrival)
+		{
+			rx_next_arrival = arrival;
+		}
+		rx_data[rx_head] = v;
+		rx_head = (rx_head + 1) & HOST_USART_BUFFER_BITS;
+	}
+}
+
+/*
+ * Fetches the oldest byte the firmware transmitted, returning zero if
+ * nothing is waiting.
+ */
+uint8_t hal_host_usart_pop(uint8_t *v)
+{
+	if (tx_head == tx_tail) return 0;
+	*v = tx_data[tx_tail];
+	tx_tail = (tx_tail + 1) & HOST_USART_BUFFER_BITS;
+	return 1;
+}
+
+
+// --- ADB line ---
+
+void hal_host_adb_init()
+{
+	device_asserting = 0;
+}
+
+uint8_t hal_host_adb_asserted()
+{
+	tick();
+	return line_level();
+}
+
+void hal_host_adb_drive(uint8_t asserted)
+{
+	tick();
+	if (device_asserting != asserted)
+	{
+		device_asserting = asserted;
+		if (hal_host_device_hook)
+		{
+			hal_host_device_hook(hal_host_cycles, asserted);
+		}
+	}
+}
+
+
+// --- Timer0 ---
+
+void hal_host_timer0_start(uint8_t cs)
+{
+	tick();
+	timer0_start = hal_host_cycles;
+	timer0_div = (cs == HAL_TIMER0_DIV64) ? 64 : 8;
+}
+
+uint8_t hal_host_timer0_read()
+{
+	tick();
+	if (! timer0_div) return 0;
+	return ((hal_host_cycles - timer0_start) / timer0_div) & 0xFF;
+}
+
+void hal_host_timer0_halt()
+{
+	tick();
+	timer0_div = 0;
+}
+
+
+// --- Timer1 ---
+// when only used for profiling this follows the wall clock (scaled to
+// F_CPU) instead of the virtual one
+
+static uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void hal_host_timer1_start()
+{
+	timer1_start_ns = monotonic_ns();
+	timer1_running = 1;
+}
+
+void hal_host_timer1_halt()
+{
+	if (timer1_running)
+	{
+		timer1_count += (monotonic_ns() - timer1_start_ns)
+				* (F_CPU / 1000000) / 1000;
+		timer1_running = 0;
+	}
+}
+
+uint16_t hal_host_timer1_read()
+{
+	if (timer1_virtual)
+	{
+		tick();
+		return (hal_host_cycles - timer1_origin) / 8;
+	}
+	uint64_t count = timer1_count;
+	if (timer1_running)
+	{
+		count += (monotonic_ns() - timer1_start_ns)
+				* (F_CPU / 1000000) / 1000;
+	}
+	return count > 0xFFFF ? 0xFFFF : count;
+}
+
+void hal_host_timer1_clear()
+{
+	timer1_count = 0;
+	timer1_start_ns = monotonic_ns();
+}
+
+
+/*
+ * Switches Timer1 over to virtual time, counting at /8 from now.
+ */
+void hal_host_timer1_free_run()
+{
+	tick();
+	if (! timer1_virtual)
+	{
+		timer1_virtual = 1;
+		timer1_origin = hal_host_cycles;
+	}
+}
+
+/*
+ * Sets up the compare match for the next time Timer1 reaches the given
+ * count, which is a full timer wrap away if that's the current count.
+ */
+void hal_host_compare_set(uint16_t t)
+{
+	tick();
+	uint64_t elapsed = hal_host_cycles - timer1_origin;
+	uint16_t ticks = t - (uint16_t) (elapsed / 8);
+	compare_at = hal_host_cycles - elapsed % 8
+			+ (ticks ? ticks : 0x10000) * (uint64_t) 8;
+	compare_enabled = 1;
+	compare_flag = 0;
+}
+
+void hal_host_compare_off()
+{
+	compare_enabled = 0;
+	compare_flag = 0;
+}
+
+
+// --- Timer1 input capture ---
+
+void hal_host_capture_init()
+{
+	hal_host_timer1_free_run();
+	capture_enabled = 1;
+	capture_line = line_level();
+	capture_rising = 0;
+	capture_flag = 0;
+}
+
+uint16_t hal_host_capture_time()
+{
+	return capture_icr;
+}
+
+uint8_t hal_host_capture_falling()
+{
+	return ! capture_rising;
+}
+
+void hal_host_capture_flip()
+{
+	capture_rising = ! capture_rising;
+	capture_flag = 0;
+}
+
+
+// --- pin change ---
+
+void hal_host_pinchange_init()
+{
+	tick();
+	pinchange_enabled = 1;
+	pinchange_line = line_level();
+	pinchange_flag = 0;
+}
+
+
+// --- idle ---
+
+void hal_host_idle()
+{
+	tick();
+}
+
+
+// --- USART ---
+
+void hal_host_usart_init()
+{
+	rx_head = rx_tail = 0;
+	rx_hw_count = 0;
+	rx_irq_enabled = 0;
+	tx_head = tx_tail = 0;
+	tx_udr_full = 0;
+	tx_irq_enabled = 0;
+}
+
+void hal_host_usart_rx_irq()
+{
+	rx_irq_enabled = 1;
+}
+
+uint8_t hal_host_usart_rx_ready()
+{
+	tick();
+	return rx_hw_count > 0;
+}
+
+uint8_t hal_host_usart_read()
+{
+	tick();
+	if (! rx_hw_count) return 0;
+	uint8_t v = rx_hw_data[0];
+	uint8_t i;
+	for (i = 1; i < rx_hw_count; i++)
+	{
+		rx_hw_data[i - 1] = rx_hw_data[i];
+	}
+	rx_hw_count--;
+	return v;
+}
+
+void hal_host_usart_tx_irq(uint8_t enabled)
+{
+	tx_irq_enabled = enabled;
+}
+
+uint8_t hal_host_usart_tx_ready()
+{
+	tick();
+	return ! tx_udr_full;
+}
+
+void hal_host_usart_write(uint8_t v)
+{
+	tick();
+	if (tx_udr_full)
+	{
+		hal_host_usart_overwrites++;
+	}
+	tx_udr = v;
+	tx_udr_full = 1;
+	service_usart();
+}
+
+
+// --- interrupts ---
+
+void hal_host_irq(uint8_t enabled)
+{
+	uint8_t was = irq_enabled;
+	irq_enabled = enabled;
+	if (enabled && ! was)
+	{
+		// anything that came up meanwhile is taken now
+		tick();
+	}
+}
+
+uint8_t hal_host_irq_save()
+{
+	uint8_t was = irq_enabled;
+	irq_enabled = 0;
+	return was;
+}
+
+
+// --- tracing ---
+
+void hal_host_trace(uint8_t code)
+{
+	if (hal_host_trace_hook)
+	{
+		hal_host_trace_hook(code);
+	}
+}
+
+
+// --- internals ---
+
+static uint8_t master_idle(uint64_t now)
+{
+	(void) now;
+	return 0;
+}
+
+static uint8_t master_script(uint64_t now)
+{
+	uint64_t t = script_start;
+	uint16_t i;
+	for (i = 0; i < script_len; i++)
+	{
+		t += HAL_HOST_US(script[i].us);
+		if (now < t) return script[i].asserted;
+	}
+	return 0;
+}
+
+/*
+ * Advances virtual time by one HAL access, stopping the run if the
+ * deadline has been reached.
+ */
+static void tick()
+{
+	hal_host_cycles += HAL_HOST_ACCESS_CYCLES;
+	if (run_active && hal_host_cycles >= run_deadline)
+	{
+		longjmp(run_env, 1);
+	}
+	if (rx_head != rx_tail || rx_hw_count || tx_udr_full || tx_irq_enabled)
+	{
+		service_usart();
+	}
+	if (pinchange_enabled)
+	{
+		service_pinchange();
+	}
+	if (timer1_virtual)
+	{
+		service_timer1();
+	}
+}
+
+/*
+ * Whether the line is asserted by anyone.
+ */
+static uint8_t line_level()
+{
+	return device_asserting || hal_host_master(hal_host_cycles);
+}
+
+/*
+ * Raises the pin change interrupt on any change of the line.
+ */
+static void service_pinchange()
+{
+	uint8_t line = line_level();
+	if (line != pinchange_line)
+	{
+		pinchange_line = line;
+		pinchange_flag = 1;
+	}
+	
+	if (pinchange_flag && irq_enabled && ! irq_active
+			&& hal_host_isr_ADB_PCINT)
+	{
+		pinchange_flag = 0;
+		irq_active = 1;
+		hal_host_cycles += HAL_HOST_ISR_CYCLES;
+		hal_host_isr_ADB_PCINT();
+		irq_active = 0;
+	}
+}
+
+/*
+ * Watches the line for the edge input capture is set for, latching
+ * the timer, and checks for compare matches, raising the interrupt
+ * for either.
+ */
+static void service_timer1()
+{
+	if (capture_enabled)
+	{
+		uint8_t line = line_level();
+		if (line != capture_line)
+		{
+			capture_line = line;
+			// an assertion is a falling edge on the pin
+			if (line != capture_rising)
+			{
+				capture_icr = (hal_host_cycles - timer1_origin) / 8;
+				capture_flag = 1;
+			}
+		}
+	}
+	if (compare_enabled && hal_host_cycles >= compare_at)
+	{
+		compare_flag = 1;
+		compare_at += 0x10000 * (uint64_t) 8;
+	}
+	
+	if (irq_enabled && ! irq_active)
+	{
+		if (capture_flag && hal_host_isr_TIMER1_CAPT)
+		{
+			irq_active = 1;
+			hal_host_cycles += HAL_HOST_ISR_CYCLES;
+			hal_host_isr_TIMER1_CAPT();
+			irq_active = 0;
+		}
+		else if (compare_flag && hal_host_isr_TIMER1_COMPA)
+		{
+			compare_flag = 0;
+			irq_active = 1;
+			hal_host_cycles += HAL_HOST_ISR_CYCLES;
+			hal_host_isr_TIMER1_COMPA();
+			irq_active = 0;
+		}
+	}
+}
+
+/*
+ * Hands a byte that has started shifting out to whoever is listening.
+ */
+static void usart_transmit(uint8_t v)
+{
+	if (hal_host_usart_sink)
+	{
+		hal_host_usart_sink(v);
+	}
+	else if (((tx_head + 1) & HOST_USART_BUFFER_BITS) != tx_tail)
+	{
+		tx_data[tx_head] = v;
+		tx_head = (tx_head + 1) & HOST_USART_BUFFER_BITS;
+	}
+}
+
+/*
+ * Moves bytes off the wire into the hardware FIFO as they arrive, and
+ * raises the receive interrupt if it is enabled.
+ */
+static void service_usart()
+{
+	while (rx_head != rx_tail && hal_host_cycles >= rx_next_arrival)
+	{
+		if (rx_hw_count < HOST_USART_HW_FIFO)
+		{
+			rx_hw_data[rx_hw_count++] = rx_data[rx_tail];
+		}
+		else
+		{
+			hal_host_usart_overruns++;
+		}
+		rx_tail = (rx_tail + 1) & HOST_USART_BUFFER_BITS;
+		rx_next_arrival += HOST_USART_BYTE_CYCLES;
+	}
+	
+	// the data register moves to the shift register once it is free
+	if (tx_udr_full && hal_host_cycles >= tx_shift_end)
+	{
+		tx_shift_end = hal_host_cycles + HOST_USART_BYTE_CYCLES;
+		tx_udr_full = 0;
+		usart_transmit(tx_udr);
+	}
+	
+	if (irq_enabled && ! irq_active)
+	{
+		if (rx_hw_count && rx_irq_enabled && hal_host_isr_USART_RX)
+		{
+			irq_active = 1;
+			hal_host_cycles += HAL_HOST_ISR_CYCLES;
+			hal_host_isr_USART_RX();
+			irq_active = 0;
+		}
+		else if (! tx_udr_full && tx_irq_enabled
+				&& hal_host_isr_USART_UDRE)
+		{
+			irq_active = 1;
+			hal_host_cycles += HAL_HOST_ISR_CYCLES;
+			hal_host_isr_USART_UDRE();
+			irq_active = 0;
+		}
+	}
+}
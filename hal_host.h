@@ -0,0 +1,203 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host (native) side of the hardware abstraction layer, selected by
+ * defining HOST_BUILD.  See hal.h for the macros these back.
+ * 
+ * Time on the host is virtual: hal_host_cycles counts simulated CPU
+ * cycles at F_CPU, and every access to the line, Timer0, or the USART
+ * advances it by HAL_HOST_ACCESS_CYCLES.  This is about what a tight
+ * AVR polling loop costs, so the busy-wait loops in adb.c see roughly
+ * the same timer values they would on real hardware.  Code that makes
+ * no HAL accesses takes no virtual time at all.
+ * 
+ * Interrupts are delivered between HAL accesses: handlers declared
+ * with HAL_ISR() are called from inside the access that first sees the
+ * interrupt condition, as if the CPU had been interrupted there.  One
+ * that comes up while interrupts are held off is delivered as they are
+ * enabled again, as the AVR does.
+ * 
+ * Timer1 normally follows the wall clock, since it is only used for
+ * profiling.  Once it is set to run free (directly, or by setting up
+ * input capture) it instead counts at /8 in virtual time, and the
+ * line is sampled on every access to timestamp its edges and raise
+ * pin change interrupts, which is accurate to within one access.
+ * Code that only waits for interrupts should call HAL_IDLE() to let
+ * time pass.
+ * 
+ * The USART receive side models the wire and the hardware: bytes
+ * queued with hal_host_usart_push() arrive one at a time at BAUD, into
+ * the same 2 byte receive FIFO the AVR has.  A byte that arrives while
+ * that is full is lost and counted in hal_host_usart_overruns.  The
+ * transmit side has the data register and shift register: a byte
+ * written while the data register is still full replaces the one
+ * waiting there, and is counted in hal_host_usart_overwrites.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef USE_USART
+	#error "Host builds only support USE_USART"
+#endif
+
+#ifndef _BV
+	#define _BV(b) (1 << (b))
+#endif
+
+#ifndef BAUD
+	#define BAUD 38400
+#endif
+
+// simulated CPU cycles consumed per HAL access
+#define HAL_HOST_ACCESS_CYCLES 4
+// and the entry and exit overhead of an interrupt handler
+#define HAL_HOST_ISR_CYCLES 20
+// helper for converting microseconds into simulated cycles
+#define HAL_HOST_US(us) ((uint64_t) (us) * (F_CPU / 1000000))
+
+/*
+ * One step of a scripted line: the line is asserted (held low) by the
+ * bus master or released for the given number of microseconds.
+ */
+struct hal_host_pulse
+{
+	uint8_t asserted;
+	uint16_t us;
+};
+
+// the virtual CPU clock
+extern uint64_t hal_host_cycles;
+// received bytes lost because the firmware did not read them in time
+extern uint32_t hal_host_usart_overruns;
+// transmitted bytes lost because they were written over
+extern uint32_t hal_host_usart_overwrites;
+
+/*
+ * The simulated bus master.  Given the current virtual time, this
+ * should return non-zero if the master is holding the line low.  The
+ * line is asserted if either the master or the device is pulling it
+ * down.  Defaults to a master that never asserts the line.
+ */
+extern uint8_t (*hal_host_master)(uint64_t);
+/*
+ * Optional notification when the device asserts (1) or releases (0)
+ * the line, given the virtual time the change happened.
+ */
+extern void (*hal_host_device_hook)(uint64_t, uint8_t);
+/*
+ * Optional receiver for the transaction codes adb.c reports through
+ * HAL_TRACE() (the same codes written in DEBUG_MODE).
+ */
+extern void (*hal_host_trace_hook)(uint8_t);
+/*
+ * Optional receiver for bytes written to the USART.  If not set, the
+ * bytes are kept for hal_host_usart_pop().
+ */
+extern void (*hal_host_usart_sink)(uint8_t);
+
+// simulation control
+uint8_t hal_host_run(void (*)(void), uint64_t);
+void hal_host_halt();
+void hal_host_line_script(const struct hal_host_pulse *, uint16_t);
+uint8_t hal_host_device_asserting();
+void hal_host_usart_push(uint8_t);
+uint8_t hal_host_usart_pop(uint8_t *);
+
+// backing implementations for hal.h
+void hal_host_adb_init();
+uint8_t hal_host_adb_asserted();
+void hal_host_adb_drive(uint8_t);
+void hal_host_timer0_start(uint8_t);
+uint8_t hal_host_timer0_read();
+void hal_host_timer0_halt();
+void hal_host_timer1_start();
+void hal_host_timer1_halt();
+uint16_t hal_host_timer1_read();
+void hal_host_timer1_clear();
+void hal_host_irq(uint8_t);
+uint8_t hal_host_irq_save();
+void hal_host_timer1_free_run();
+void hal_host_compare_set(uint16_t);
+void hal_host_compare_off();
+void hal_host_capture_init();
+uint16_t hal_host_capture_time();
+uint8_t hal_host_capture_falling();
+void hal_host_capture_flip();
+void hal_host_pinchange_init();
+void hal_host_idle();
+void hal_host_usart_init();
+void hal_host_usart_rx_irq();
+uint8_t hal_host_usart_rx_ready();
+uint8_t hal_host_usart_read();
+void hal_host_usart_tx_irq(uint8_t);
+uint8_t hal_host_usart_tx_ready();
+void hal_host_usart_write(uint8_t);
+void hal_host_trace(uint8_t);
+
+#define HAL_ISR(v) void hal_host_isr_##v()
+#define HAL_IRQ_ENABLE() hal_host_irq(1)
+#define HAL_IRQ_DISABLE() hal_host_irq(0)
+#define HAL_IRQ_SAVE() hal_host_irq_save()
+#define HAL_IRQ_RESTORE(s) hal_host_irq(s)
+#define HAL_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+#define HAL_ADB_INIT() hal_host_adb_init()
+#define HAL_ADB_IS_ASSERTED() hal_host_adb_asserted()
+#define HAL_ADB_ASSERT() hal_host_adb_drive(1)
+#define HAL_ADB_RELEASE() hal_host_adb_drive(0)
+
+#define HAL_TIMER0_START(cs) hal_host_timer0_start(cs)
+#define HAL_TIMER0_READ() hal_host_timer0_read()
+#define HAL_TIMER0_HALT() hal_host_timer0_halt()
+
+#define HAL_TIMER1_START() hal_host_timer1_start()
+#define HAL_TIMER1_HALT() hal_host_timer1_halt()
+#define HAL_TIMER1_READ() hal_host_timer1_read()
+#define HAL_TIMER1_CLEAR() hal_host_timer1_clear()
+
+#define HAL_TIMER1_FREE_RUN() hal_host_timer1_free_run()
+#define HAL_COMPARE_SET(t) hal_host_compare_set(t)
+#define HAL_COMPARE_OFF() hal_host_compare_off()
+
+#define HAL_PINCHANGE_INIT() hal_host_pinchange_init()
+
+#define HAL_IDLE() hal_host_idle()
+
+#define HAL_CAPTURE_INIT() hal_host_capture_init()
+#define HAL_CAPTURE_TIME() hal_host_capture_time()
+#define HAL_CAPTURE_FALLING() hal_host_capture_falling()
+#define HAL_CAPTURE_FLIP() hal_host_capture_flip()
+
+#define HAL_USART_INIT() hal_host_usart_init()
+#define HAL_USART_RX_IRQ_ENABLE() hal_host_usart_rx_irq()
+#define HAL_USART_RX_READY() hal_host_usart_rx_ready()
+#define HAL_USART_READ() hal_host_usart_read()
+#define HAL_USART_TX_IRQ_ENABLE() hal_host_usart_tx_irq(1)
+#define HAL_USART_TX_IRQ_DISABLE() hal_host_usart_tx_irq(0)
+#define HAL_USART_TX_READY() hal_host_usart_tx_ready()
+#define HAL_USART_WRITE(v) hal_host_usart_write(v)
+
+#define HAL_TRACE(c) hal_host_trace(c)
+
+#define HAL_FLASH
+#define HAL_FLASH_BYTE(p) (*(p))
+#define HAL_FLASH_FUNC(type, p) (*(p))
@@ -17,7 +17,6 @@
  * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <avr/io.h>
 #include "adb.h"
 
 // reminder for F_CPU
@@ -37,9 +36,8 @@
 
 int main()
 {
-	// before any ADB communication, ensure that the ADB pin will go
-	// low when the direction is changed
-	ADB_PORT &= ~_BV(ADB_DATA_BIT);
+	// before any ADB communication, set up the line and timers
+	adb_init();
 	
 	// perform an initial reset of the ADB system
 	adb_reset();
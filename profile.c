@@ -0,0 +1,62 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+
+#ifdef PROFILE
+
+struct profile profile_slots[PROFILE_SLOTS];
+
+/*
+ * Starts the given slot over, as if it had never been called.
+ */
+void profile_clear(uint8_t slot)
+{
+	struct profile *p = &profile_slots[slot];
+	p->count = 0;
+	p->min = 0;
+	p->max = 0;
+	p->total = 0;
+}
+
+/*
+ * Copies a slot out and starts it over in one go, with interrupts held
+ * off, since the ADB paths record from interrupt context.
+ */
+void profile_take(uint8_t slot, struct profile *out)
+{
+	uint8_t sreg = HAL_IRQ_SAVE();
+	*out = profile_slots[slot];
+	profile_clear(slot);
+	HAL_IRQ_RESTORE(sreg);
+}
+
+/*
+ * Adds one call of the given length to a slot.
+ */
+void profile_record(uint8_t slot, uint16_t ticks)
+{
+	struct profile *p = &profile_slots[slot];
+	if (p->count == 0 || ticks < p->min) p->min = ticks;
+	if (ticks > p->max) p->max = ticks;
+	p->count++;
+	p->total += ticks;
+}
+
+#endif /* PROFILE */
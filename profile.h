@@ -0,0 +1,73 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Service time counters for the hot paths, built in with PROFILE.
+ * 
+ * Each slot keeps the number of calls and the shortest, longest and
+ * total time taken.  Times are in Timer1 ticks, not CPU cycles: Timer1
+ * free-runs at /8 for the ADB engines, so a tick is PROFILE_TICK_CYCLES
+ * cycles, or 0.5us at 16MHz.  A single call over ~32ms will wrap;
+ * nothing on the hot paths comes close.  Calls nested in a timed call
+ * count towards both.  The counters are read over the serial link
+ * with the QUERY command, see handle_query().
+ * 
+ * Without PROFILE the macros compile away to nothing.
+ */
+
+#pragma once
+
+#include "hal.h"
+
+#define PROFILE_HANDLE_DATA 0
+#define PROFILE_SERIAL_DATA 1
+#define PROFILE_SRQ 2
+#define PROFILE_TALK 3
+#define PROFILE_LISTEN 4
+#define PROFILE_SLOTS 5
+
+// CPU cycles per Timer1 tick, the prescaler of HAL_TIMER1_FREE_RUN()
+#define PROFILE_TICK_CYCLES 8
+
+#ifdef PROFILE
+
+struct profile
+{
+	uint16_t count;
+	uint16_t min;
+	uint16_t max;
+	uint32_t total;
+};
+
+extern struct profile profile_slots[PROFILE_SLOTS];
+
+void profile_clear(uint8_t);
+void profile_take(uint8_t, struct profile *);
+void profile_record(uint8_t, uint16_t);
+
+#define PROFILE_BEGIN(t) uint16_t t = HAL_TIMER1_READ()
+#define PROFILE_END(slot, t) \
+		profile_record((slot), HAL_TIMER1_READ() - (t))
+
+#else /* ! PROFILE */
+
+#define PROFILE_BEGIN(t) ((void) 0)
+#define PROFILE_END(slot, t) ((void) 0)
+
+#endif /* PROFILE */
@@ -18,106 +18,276 @@
  */
 
 #include "registers.h"
+#include "stats.h"
 
-void reset_registers()
-{
+// one slot per keyboard and mouse, each with its own registers
+#define KBD_DEVICE(n) { \
+		&kbd_addr[n], &kbd_handler[n], \
+		&kbd_init_addr, &kbd_init_handler, \
+		/* handlers 2 or 3 only */ \
+		(1 << 2) | (1 << 3), \
+		KBD_SRQ_CLASS, \
+		kbd_talk, kbd_talk_drain, kbd_listen, kbd_srq, \
+		reset_kbd_data, reset_kbd_data, n \
+	}
+#define MSE_DEVICE(n) { \
+		&mse_addr[n], &mse_handler[n], \
+		&mse_init_addr, &mse_init_handler, \
+		/* standard 100 or 200 cpi, or the extended protocol */ \
+		(1 << 1) | (1 << 2) | (1 << 4), \
+		MSE_SRQ_CLASS, \
+		/* does not listen to anything at this point */ \
+		mse_talk, mse_talk_drain, 0, mse_srq, \
+		reset_mse_data, reset_mse_data, n \
+	}
+
+const struct adb_device adb_devices[ADB_DEVICES] = {
 	#ifdef USE_KEYBOARD
-		reset_kbd_data();
+		KBD_DEVICE(0),
+		#if KBD_COUNT > 1
+			KBD_DEVICE(1),
+		#endif
+		#if KBD_COUNT > 2
+			KBD_DEVICE(2),
+		#endif
+		#if KBD_COUNT > 3
+			KBD_DEVICE(3),
+		#endif
 	#endif
 	#ifdef USE_MOUSE
-		reset_mse_data();
+		MSE_DEVICE(0),
+		#if MSE_COUNT > 1
+			MSE_DEVICE(1),
+		#endif
+		#if MSE_COUNT > 2
+			MSE_DEVICE(2),
+		#endif
+		#if MSE_COUNT > 3
+			MSE_DEVICE(3),
+		#endif
 	#endif
 	#ifdef USE_ARBITRARY
-		reset_arb_data();
+		{
+			&arb_addr, &arb_handler, &arb_init_addr, &arb_init_handler,
+			0, ARB_SRQ_CLASS,
+			arb_talk, arb_talk_drain, arb_listen, arb_srq,
+			arb_flush, reset_arb_data, 0
+		},
 	#endif
-}
+};
+
+uint8_t adb_map[16];
 
-uint8_t devices_needing_srq()
+void device_map_update()
 {
-	uint8_t srq = 0;
+	uint8_t i;
 	
-	// keyboard needs servicing if any chars are in buffer
-	#ifdef USE_KEYBOARD
-	if (! ring_buffer_empty(&kbd_buf))
+	for (i = 0; i < 16; i++)
 	{
-		srq |= ADB_KBD_FLAG_MASK;
+		adb_map[i] = 0;
 	}
-	#endif
-	
-	// mouse needs servicing if it has button changes *or* movement
-	#ifdef USE_MOUSE
-	if (mse_btn_data != mse_btn_reported || mse_x != 0 || mse_y != 0)
+	// in reverse, so earlier devices win any shared address
+	i = ADB_DEVICES;
+	while (i--)
 	{
-		srq |= ADB_MSE_FLAG_MASK;
+		adb_map[*adb_devices[i].addr & 15] = 1 << i;
 	}
-	#endif
+}
+
+const struct adb_device *device_lookup(uint8_t target)
+{
+	const struct adb_device *dev = adb_devices;
+	while (! (target & 1))
+	{
+		target >>= 1;
+		dev++;
+	}
+	return dev;
+}
+
+void reset_registers()
+{
+	uint8_t i;
+	for (i = 0; i < ADB_DEVICES; i++)
+	{
+		adb_devices[i].reset(adb_devices[i].inst);
+		device_staged_len[i] = 0;
+	}
+	device_changed((1 << ADB_DEVICES) - 1);
+}
+
+void device_flush(uint8_t target)
+{
+	const struct adb_device *dev = device_lookup(target);
+	dev->flush(dev->inst);
+	device_staged_len[dev - adb_devices] = 0;
+	device_changed(target);
+}
+
+uint8_t device_srq;
+uint8_t device_staged[ADB_DEVICES][8];
+uint8_t device_staged_len[ADB_DEVICES];
+uint8_t device_stale;
+volatile uint8_t device_sending;
+volatile uint8_t device_staging;
+uint8_t device_defer;
+uint8_t device_starve[ADB_DEVICES];
+
+// devices needing servicing, including any held back
+static uint8_t device_waiting;
+
+/*
+ * Works out device_defer and device_srq from the waiting devices and
+ * their starvation counts.
+ */
+static void device_schedule()
+{
+	uint8_t urgent = 0xFF;
+	uint8_t defer = 0;
+	uint8_t i;
+	uint8_t bit;
 	
-	// arb needs servicing only if asked for it
-	#ifdef USE_ARBITRARY
-	if (arb_buf0_set)
+	for (i = 0, bit = 1; i < ADB_DEVICES; i++, bit <<= 1)
 	{
-		srq |= ADB_ARB_FLAG_MASK;
+		if ((device_waiting & bit) && adb_devices[i].srq_class < urgent)
+		{
+			urgent = adb_devices[i].srq_class;
+		}
 	}
-	#endif
+	for (i = 0, bit = 1; i < ADB_DEVICES; i++, bit <<= 1)
+	{
+		if ((device_waiting & bit) && adb_devices[i].srq_class > urgent
+				&& device_starve[i] < SRQ_STARVE_LIMIT)
+		{
+			defer |= bit;
+		}
+	}
+	device_defer = defer;
+	device_srq = device_waiting & ~defer;
+}
+
+void device_changed(uint8_t target)
+{
+	uint8_t i;
+	uint8_t bit = 1;
 	
-	return srq;
+	device_stale |= target;
+	for (i = 0; i < ADB_DEVICES; i++, bit <<= 1)
+	{
+		if (! (target & bit)) continue;
+		if (adb_devices[i].srq(adb_devices[i].inst))
+		{
+			device_waiting |= bit;
+		}
+		else
+		{
+			device_waiting &= ~bit;
+			device_starve[i] = 0;
+		}
+	}
+	device_schedule();
 }
 
-void device_flush(uint8_t target)
+void device_serviced(uint8_t target)
 {
-	if (target & ADB_KBD_FLAG_MASK)
+	uint8_t i;
+	uint8_t bit = 1;
+	
+	for (i = 0; i < ADB_DEVICES; i++, bit <<= 1)
 	{
-		#ifdef USE_KEYBOARD
-		reset_kbd_data();
-		#endif
+		if (target & bit)
+		{
+			device_starve[i] = 0;
+		}
+		else if ((device_waiting & bit) && device_starve[i] != 0xFF)
+		{
+			device_starve[i]++;
+		}
 	}
-	else if (target & ADB_MSE_FLAG_MASK)
+}
+
+void device_stage()
+{
+	// picked and marked at once, so a talk from the event engine's
+	// interrupts either sends the old copy first, and the device is
+	// skipped, or finds it marked
+	uint8_t sreg = HAL_IRQ_SAVE();
+	uint8_t stale = device_stale & ADB_STAGED_MASK & ~device_sending;
+	uint8_t i = 0;
+	if (stale)
 	{
-		#ifdef USE_MOUSE
-		reset_mse_data();
-		#endif
+		// only the first one, to keep each call short
+		while (! (stale & 1))
+		{
+			stale >>= 1;
+			i++;
+		}
+		device_staging = 1 << i;
 	}
-	else if (target & ADB_ARB_FLAG_MASK)
+	HAL_IRQ_RESTORE(sreg);
+	if (! stale) return;
+	
+	uint8_t buf[8];
+	uint8_t len = adb_devices[i].talk(adb_devices[i].inst, buf, 0);
+	
+	// swapped in all at once, since those interrupts may send the old
+	// copy right up until then
+	sreg = HAL_IRQ_SAVE();
+	uint8_t j;
+	for (j = 0; j < len; j++)
 	{
-		#ifdef USE_ARBITRARY
-		reset_arb_data();
-		#endif
+		device_staged[i][j] = buf[j];
 	}
+	device_staged_len[i] = len;
+	device_stale &= ~(1 << i);
+	device_staging = 0;
+	HAL_IRQ_RESTORE(sreg);
 }
 
 
 // --- KEYBOARD ---
 #ifdef USE_KEYBOARD
 
-uint8_t kbd_addr;
-uint8_t kbd_handler;
-struct buffer kbd_buf;
-uint8_t kbd_reg2_low;
-uint8_t kbd_reg2_high;
+uint8_t kbd_addr[KBD_COUNT];
+uint8_t kbd_handler[KBD_COUNT];
+uint8_t kbd_init_addr = 2;
+uint8_t kbd_init_handler = 2;
+struct buffer kbd_buf[KBD_COUNT];
+uint8_t kbd_reg2_low[KBD_COUNT];
+uint8_t kbd_reg2_high[KBD_COUNT];
+
 
+static uint8_t kbd_talk_size[KBD_COUNT];
 
-static uint8_t kbd_talk_size = 0;
+void reset_kbd_data(uint8_t inst)
+{
+	ring_buffer_clear(&kbd_buf[inst]);
+	kbd_reg2_low[inst] = ~0;
+	kbd_reg2_high[inst] = ~0;
+	kbd_talk_size[inst] = 0;
+}
 
-void reset_kbd_data()
+void kbd_clear(uint8_t inst)
 {
-	ring_buffer_clear(&kbd_buf);
-	kbd_reg2_low = ~0;
-	kbd_reg2_high = ~0;
-	kbd_talk_size = 0;
+	ring_buffer_clear(&kbd_buf[inst]);
+	// anything in flight is gone too, so the drain must not take keys
+	// that arrive after this
+	kbd_talk_size[inst] = 0;
+	device_changed(ADB_KBD_FLAG_MASK(inst));
 }
 
-uint8_t kbd_talk(uint8_t *xmit, uint8_t reg)
+uint8_t kbd_talk(uint8_t inst, uint8_t *xmit, uint8_t reg)
 {
 	if (reg == 0)
 	{
-		kbd_talk_size = ring_buffer_size(&kbd_buf);
-		if (kbd_talk_size == 0)
+		kbd_talk_size[inst] = ring_buffer_size(&kbd_buf[inst]);
+		if (kbd_talk_size[inst] == 0)
 		{
 			return 0;
 		}
 		else
 		{
-			uint16_t kbd = ring_buffer_peek(&kbd_buf);
+			uint16_t kbd = ring_buffer_peek(&kbd_buf[inst]);
 			xmit[0] = kbd >> 8;
 			xmit[1] = kbd;
 			return 2;
@@ -125,15 +295,15 @@ uint8_t kbd_talk(uint8_t *xmit, uint8_t reg)
 	}
 	else if (reg == 2)
 	{
-		xmit[0] = kbd_reg2_high;
-		xmit[1] = kbd_reg2_low;
+		xmit[0] = kbd_reg2_high[inst];
+		xmit[1] = kbd_reg2_low[inst];
 		return 2;
 	}
 	else if (reg == 3)
 	{
 		xmit[0] = 0x60; // per ADB protocol
-		xmit[0] += kbd_addr;
-		xmit[1] = kbd_handler;
+		xmit[0] += kbd_addr[inst];
+		xmit[1] = kbd_handler[inst];
 		return 2;
 	}
 	else
@@ -142,92 +312,291 @@ uint8_t kbd_talk(uint8_t *xmit, uint8_t reg)
 	}
 }
 
-void kbd_talk_drain(uint8_t reg)
+void kbd_talk_drain(uint8_t inst, uint8_t reg)
 {
 	if (reg == 0)
 	{
-		ring_buffer_drain(&kbd_buf, kbd_talk_size);
+		ring_buffer_drain(&kbd_buf[inst], kbd_talk_size[inst]);
 	}
 }
 
-void kbd_listen(uint8_t reg, uint16_t data)
+void kbd_listen(uint8_t inst, uint8_t reg, const uint8_t *data, uint8_t len)
 {
+	(void) len;
 	if (reg == 2)
 	{
 		// set LEDs only
-		kbd_reg2_low = (kbd_reg2_low & 0xF8)
-				+ (data & 0x07);
+		kbd_reg2_low[inst] = (kbd_reg2_low[inst] & 0xF8)
+				+ (data[1] & 0x07);
 	}
 }
 
+uint8_t kbd_srq(uint8_t inst)
+{
+	// needs servicing if any chars are in buffer
+	return ! ring_buffer_empty(&kbd_buf[inst]);
+}
+
 #endif /* USE_KEYBOARD */
 
 
 // --- MOUSE ---
 #ifdef USE_MOUSE
 
-uint8_t mse_addr;
-uint8_t mse_handler;
+uint8_t mse_addr[MSE_COUNT];
+uint8_t mse_handler[MSE_COUNT];
+uint8_t mse_init_addr = 3;
 uint8_t mse_init_handler = 1;
-uint8_t mse_btn_data;
-uint8_t mse_btn_reported;
-int16_t mse_x;
-int16_t mse_y;
-static int8_t mse_x_last = 0;
-static int8_t mse_y_last = 0;
+uint8_t mse_btn_data[MSE_COUNT];
+uint8_t mse_btn_reported[MSE_COUNT];
+int16_t mse_x[MSE_COUNT];
+int16_t mse_y[MSE_COUNT];
 
-void reset_mse_data()
+// the last register 0 report built, which its drain takes off the
+// live state above
+struct mse_report
 {
-	mse_btn_data = 0;
-	mse_btn_reported = 0;
-	mse_x = 0;
-	mse_y = 0;
+	int16_t x;
+	int16_t y;
+	uint8_t btn;
+};
+static struct mse_report mse_sent[MSE_COUNT];
+
+#ifdef USE_MOUSE_SHAPING
+	uint16_t mse_poll_interval[MSE_COUNT];
+	// whether motion is waiting, how long it has, and when that was
+	// last brought up to date
+	static uint8_t mse_waiting[MSE_COUNT];
+	static uint16_t mse_age[MSE_COUNT];
+	static uint16_t mse_age_last[MSE_COUNT];
+	// when the last report that left motion behind was drained, with a
+	// flag for that being valid
+	static uint16_t mse_drained[MSE_COUNT];
+	static uint8_t mse_drained_valid[MSE_COUNT];
+	static uint8_t mse_pending(uint8_t);
+	static uint16_t mse_major(uint8_t);
+	static uint8_t mse_shaped(uint8_t, uint16_t);
+#endif
+
+// extended mouse register 1: identifier, resolution in counts per
+// inch, class (mouse), and number of buttons
+static const uint8_t mse_ext_info[8] = {
+	'T', 'R', 'A', 'B', 0x00, 0xC8, 0x01, 0x08
+};
+
+void reset_mse_data(uint8_t inst)
+{
+	mse_btn_data[inst] = 0;
+	mse_btn_reported[inst] = 0;
+	mse_x[inst] = 0;
+	mse_y[inst] = 0;
+	mse_sent[inst].x = 0;
+	mse_sent[inst].y = 0;
+	mse_sent[inst].btn = 0;
+	#ifdef USE_MOUSE_SHAPING
+		mse_waiting[inst] = 0;
+		mse_age[inst] = 0;
+		mse_drained_valid[inst] = 0;
+		mse_poll_interval[inst] = 0;
+	#endif
 }
 
-uint8_t mse_talk(uint8_t *xmit, uint8_t reg)
+/*
+ * Adds motion from the host to what is waiting to be reported.
+ */
+void mse_move(uint8_t inst, int16_t dx, int16_t dy)
 {
-	if (reg == 0
-		&& (mse_x != 0
-				|| mse_y != 0
-				|| mse_btn_data != mse_btn_reported))
+	#ifdef USE_MOUSE_SHAPING
+		mse_age_update(inst);
+		if (! mse_waiting[inst] && (dx || dy))
+		{
+			mse_age[inst] = 0;
+			mse_waiting[inst] = 1;
+		}
+	#endif
+	mse_x[inst] += dx;
+	mse_y[inst] += dy;
+	device_changed(ADB_MSE_FLAG_MASK(inst));
+}
+
+void mse_clear(uint8_t inst, uint8_t what)
+{
+	// a report in flight keeps the buttons it sent, which is still
+	// right, but must not take back motion that was cleared
+	if (what & MSE_CLEAR_BTN)
 	{
-		// gather x, y bits
-		if (mse_x < 0)
+		mse_btn_data[inst] = 0;
+	}
+	if (what & MSE_CLEAR_X)
+	{
+		mse_x[inst] = 0;
+		mse_sent[inst].x = 0;
+	}
+	if (what & MSE_CLEAR_Y)
+	{
+		mse_y[inst] = 0;
+		mse_sent[inst].y = 0;
+	}
+	device_changed(ADB_MSE_FLAG_MASK(inst));
+}
+
+#ifdef USE_MOUSE_SHAPING
+static uint8_t mse_pending(uint8_t inst)
+{
+	return mse_x[inst] != 0 || mse_y[inst] != 0;
+}
+
+/*
+ * Gives the size of the pending motion along its larger axis.
+ */
+static uint16_t mse_major(uint8_t inst)
+{
+	uint16_t ax = mse_x[inst] < 0 ? -mse_x[inst] : mse_x[inst];
+	uint16_t ay = mse_y[inst] < 0 ? -mse_y[inst] : mse_y[inst];
+	return ax > ay ? ax : ay;
+}
+
+/*
+ * Gives how many reports the pending motion needs at the current
+ * handler, or zero if there isn't any.
+ */
+uint8_t mse_backlog(uint8_t inst)
+{
+	if (! mse_pending(inst)) return 0;
+	if (mse_handler[inst] == 4) return 1;
+	
+	uint16_t n = (mse_major(inst) + 62) / 63;
+	return n > 0xFF ? 0xFF : n;
+}
+
+void mse_age_update(uint8_t inst)
+{
+	uint16_t now = HAL_TIMER1_READ();
+	if (mse_waiting[inst])
+	{
+		uint16_t d = now - mse_age_last[inst];
+		if (d > MSE_AGE_MAX - mse_age[inst])
 		{
-			if (mse_x < -64) mse_x_last = -64;
-			else mse_x_last = (int8_t) mse_x;
+			mse_age[inst] = MSE_AGE_MAX;
 		}
 		else
 		{
-			if (mse_x > 63) mse_x_last = 63;
-			else mse_x_last = (int8_t) mse_x;
+			mse_age[inst] += d;
 		}
-		if (mse_y < 0)
+	}
+	mse_age_last[inst] = now;
+}
+
+uint16_t mse_backlog_age(uint8_t inst)
+{
+	return mse_waiting[inst] ? mse_age[inst] : 0;
+}
+
+/*
+ * Decides whether a move too big for one report keeps its direction.
+ * That holds back some of the smaller axis, which is only worth it if
+ * the host, polling as fast as it has been, takes the rest within
+ * MSE_SHAPE_WINDOW.  Otherwise, or before the rate is known, each axis
+ * is sent as fast as it can be.
+ */
+static uint8_t mse_shaped(uint8_t inst, uint16_t m)
+{
+	uint16_t t = mse_poll_interval[inst];
+	return t != 0 && (uint32_t) ((m + 62) / 63) * t <= MSE_SHAPE_WINDOW;
+}
+#endif /* USE_MOUSE_SHAPING */
+
+/*
+ * Limits a pending movement to what fits in a single report.
+ */
+static int16_t mse_clamp(int16_t v, int16_t limit)
+{
+	if (v < -limit) return -limit;
+	else if (v > limit - 1) return limit - 1;
+	else return v;
+}
+
+uint8_t mse_talk(uint8_t inst, uint8_t *xmit, uint8_t reg)
+{
+	#ifdef USE_MOUSE_SHAPING
+	if (reg == 0)
+	{
+		mse_age_update(inst);
+	}
+	#endif /* USE_MOUSE_SHAPING */
+	
+	if (reg == 0
+		&& (mse_x[inst] != 0
+				|| mse_y[inst] != 0
+				|| mse_btn_data[inst] != mse_btn_reported[inst]))
+	{
+		struct mse_report *sent = &mse_sent[inst];
+		uint8_t len = 2;
+		sent->btn = mse_btn_data[inst];
+		if (mse_handler[inst] == 4)
 		{
-			if (mse_y < -64) mse_y_last = -64;
-			else mse_y_last = (int8_t) mse_y;
+			// extended protocol: each extra byte adds 3 bits to both
+			// deltas and two more buttons, so the full 16 bits and
+			// all 8 buttons fit in 5 bytes
+			uint8_t i;
+			uint16_t x = (uint16_t) mse_x[inst];
+			uint16_t y = (uint16_t) mse_y[inst];
+			sent->x = mse_x[inst];
+			sent->y = mse_y[inst];
+			for (i = 2; i < MSE_EXT_LEN; i++)
+			{
+				uint8_t shift = 7 + (i - 2) * 3;
+				xmit[i] = (((y >> shift) & 7) << 4) | ((x >> shift) & 7);
+				xmit[i] |= ((~sent->btn >> (i * 2 - 2)) & 1) << 7;
+				xmit[i] |= ((~sent->btn >> (i * 2 - 1)) & 1) << 3;
+			}
+			len = MSE_EXT_LEN;
 		}
 		else
 		{
-			if (mse_y > 63) mse_y_last = 63;
-			else mse_y_last = (int8_t) mse_y;
+			#ifdef USE_MOUSE_SHAPING
+				// a move too big for one report can be sent as a
+				// full step along its larger axis, with the other
+				// scaled to match, rather than clamping each axis
+				// on its own, which bends diagonal moves
+				uint16_t m = mse_major(inst);
+				if (m > 63 && mse_shaped(inst, m))
+				{
+					sent->x = (int32_t) mse_x[inst] * 63 / m;
+					sent->y = (int32_t) mse_y[inst] * 63 / m;
+				}
+				else
+			#endif
+				{
+					sent->x = mse_clamp(mse_x[inst], 64);
+					sent->y = mse_clamp(mse_y[inst], 64);
+				}
 		}
 		
 		// then store in two's complement
-		xmit[0] = mse_y_last & 0x7F;
-		xmit[1] = mse_x_last & 0x7F;
+		xmit[0] = sent->y & 0x7F;
+		xmit[1] = sent->x & 0x7F;
 		
 		// do buttons
-		xmit[0] |= ((~mse_btn_data) & 1) << 7;
-		xmit[1] |= ((~mse_btn_data) & 2) << 6;
+		xmit[0] |= ((~sent->btn) & 1) << 7;
+		xmit[1] |= ((~sent->btn) & 2) << 6;
 		
-		return 2;
+		return len;
+	}
+	else if (reg == 1 && mse_handler[inst] == 4)
+	{
+		uint8_t i;
+		for (i = 0; i < 8; i++)
+		{
+			xmit[i] = mse_ext_info[i];
+		}
+		return 8;
 	}
 	else if (reg == 3)
 	{
 		xmit[0] = 0x60;
-		xmit[0] += mse_addr;
-		xmit[1] = mse_handler;
+		xmit[0] += mse_addr[inst];
+		xmit[1] = mse_handler[inst];
 		return 2;
 	}
 	else
@@ -236,16 +605,48 @@ uint8_t mse_talk(uint8_t *xmit, uint8_t reg)
 	}
 }
 
-void mse_talk_drain(uint8_t reg)
+void mse_talk_drain(uint8_t inst, uint8_t reg)
 {
 	if (reg == 0)
 	{
-		mse_btn_reported = mse_btn_data;
-		mse_x -= mse_x_last;
-		mse_y -= mse_y_last;
+		// exactly what was sent, whatever came in since
+		mse_btn_reported[inst] = mse_sent[inst].btn;
+		mse_x[inst] -= mse_sent[inst].x;
+		mse_y[inst] -= mse_sent[inst].y;
+		#ifdef USE_MOUSE_SHAPING
+			// the host polls the mouse back to back while it has
+			// motion, so only intervals after a report that left some
+			// say how fast it is being taken; they are averaged over
+			// the last 8 or so
+			mse_age_update(inst);
+			uint16_t now = mse_age_last[inst];
+			if (mse_drained_valid[inst])
+			{
+				uint16_t d = now - mse_drained[inst];
+				if (d == 0) d = 1;
+				if (mse_poll_interval[inst] == 0)
+				{
+					mse_poll_interval[inst] = d;
+				}
+				else
+				{
+					mse_poll_interval[inst] = mse_poll_interval[inst]
+							- (mse_poll_interval[inst] >> 3) + (d >> 3);
+				}
+			}
+			mse_drained[inst] = now;
+			mse_drained_valid[inst] = mse_pending(inst);
+			if (! mse_pending(inst)) mse_waiting[inst] = 0;
+		#endif
 	}
 }
 
+uint8_t mse_srq(uint8_t inst)
+{
+	// needs servicing if it has button changes *or* movement
+	return mse_btn_data[inst] != mse_btn_reported[inst] || mse_x[inst] != 0 || mse_y[inst] != 0;
+}
+
 #endif /* USE_MOUSE */
 
 
@@ -258,33 +659,149 @@ uint8_t arb_init_addr = 7;
 uint8_t arb_init_handler = 0xFC;
 uint8_t arb_buf0[ARB_BUF0_SIZE];
 uint8_t arb_buf0_len;
-uint8_t arb_buf0_set;
+uint8_t arb_queue_count;
 uint8_t arb_buf2_low;
 uint8_t arb_buf2_high;
 uint8_t arb_buf2_set;
+struct fifo arb_rx;
+
+// queued register 0 packets, oldest at arb_queue_head
+static uint8_t arb_queue[ARB_QUEUE_SIZE][ARB_BUF0_SIZE];
+static uint8_t arb_queue_len[ARB_QUEUE_SIZE];
+static uint8_t arb_queue_head;
+// set when the oldest packet has been handed to a talk, so a drain
+// after the queue was cleared doesn't take a newer one
+static uint8_t arb_queue_talked;
+
+#ifdef USE_ARB_TRANSPORT
+	// packets from the head sent since the last resend, and the most
+	// that have ever been, the sequence number of the head, the next
+	// one expected from the Mac, and the polls since there was last
+	// something new to send
+	static uint8_t arb_queue_sent;
+	static uint8_t arb_queue_out;
+	static uint8_t arb_tx_seq;
+	static uint8_t arb_rx_seq;
+	static uint8_t arb_idle_polls;
+	static void arb_ack(uint8_t);
+#endif
 
-void reset_arb_data()
+void reset_arb_data(uint8_t inst)
 {
+	(void) inst;
 	arb_buf0_len = 0;
-	arb_buf0_set = 0;
+	arb_queue_clear();
 	arb_buf2_low = 0;
 	arb_buf2_high = 0;
 	arb_buf2_set = 0;
+	fifo_clear(&arb_rx);
+}
+
+#ifdef USE_ARB_TRANSPORT
+/*
+ * Restarts both sequences, keeping the data.  Anything queued is sent
+ * again from the start.
+ */
+void arb_transport_reset()
+{
+	arb_queue_sent = 0;
+	arb_queue_out = 0;
+	arb_queue_talked = 0;
+	arb_tx_seq = 0;
+	arb_rx_seq = 0;
+	arb_idle_polls = 0;
+}
+#endif /* USE_ARB_TRANSPORT */
+
+/*
+ * Moves the staged register 0 data onto the end of the queue, if there
+ * is enough of it to make a packet.  Returns zero, leaving the data
+ * staged, if there wasn't or the queue is full.
+ */
+uint8_t arb_queue_push()
+{
+	if (arb_buf0_len < ARB_PACKET_MIN || arb_buf0_len > ARB_PACKET_MAX
+			|| arb_queue_count >= ARB_QUEUE_SIZE)
+	{
+		return 0;
+	}
+	
+	uint8_t slot = (arb_queue_head + arb_queue_count) & ARB_QUEUE_BITS;
+	uint8_t i;
+	for (i = 0; i < arb_buf0_len; i++)
+	{
+		arb_queue[slot][i] = arb_buf0[i];
+	}
+	arb_queue_len[slot] = arb_buf0_len;
+	// a transport talk from the event engine's interrupts may read the
+	// slot as soon as it's counted, so it must be filled first
+	HAL_BARRIER();
+	arb_queue_count++;
+	arb_buf0_len = 0;
+	device_changed(ADB_ARB_FLAG_MASK);
+	return 1;
+}
+
+void arb_queue_clear()
+{
+	// and a transport talk must see the queue as it was or cleared,
+	// not partway
+	uint8_t sreg = HAL_IRQ_SAVE();
+	arb_queue_head = 0;
+	arb_queue_count = 0;
+	arb_queue_talked = 0;
+	#ifdef USE_ARB_TRANSPORT
+		arb_transport_reset();
+	#endif
+	HAL_IRQ_RESTORE(sreg);
+	device_changed(ADB_ARB_FLAG_MASK);
 }
 
-uint8_t arb_talk(uint8_t *xmit, uint8_t reg)
+uint8_t arb_talk(uint8_t inst, uint8_t *xmit, uint8_t reg)
 {
-	if (reg == 0 && arb_buf0_set)
+	(void) inst;
+	#ifdef USE_ARB_TRANSPORT
+	if (reg == 0 && arb_queue_count)
+	{
+		if (arb_queue_sent >= arb_queue_count)
+		{
+			// everything is out but not acknowledged yet.  give the
+			// Mac a few polls, then go back and send it all again
+			if (++arb_idle_polls < ARB_RESEND_POLLS) return 0;
+			arb_queue_sent = 0;
+		}
+		arb_idle_polls = 0;
+		
+		uint8_t i;
+		uint8_t slot = (arb_queue_head + arb_queue_sent) & ARB_QUEUE_BITS;
+		uint8_t seq = (arb_tx_seq + arb_queue_sent) & 0x0F;
+		xmit[0] = (seq << 4) | arb_rx_seq;
+		for (i = 0; i < arb_queue_len[slot]; i++)
+		{
+			xmit[i + 1] = arb_queue[slot][i];
+		}
+		arb_queue_talked = 1;
+		return arb_queue_len[slot] + 1;
+	}
+	else if (reg == 1)
+	{
+		xmit[0] = (arb_tx_seq << 4) | arb_rx_seq;
+		xmit[1] = FIFO_BITS - fifo_count(&arb_rx);
+		return 2;
+	}
+	#else
+	if (reg == 0 && arb_queue_count)
 	{
 		uint8_t i;
-		uint8_t xmit_len = arb_buf0_len;
-		if (xmit_len > 8) xmit_len = 8;
+		uint8_t xmit_len = arb_queue_len[arb_queue_head];
 		for (i = 0; i < xmit_len; i++)
 		{
-			xmit[i] = arb_buf0[i];
+			xmit[i] = arb_queue[arb_queue_head][i];
 		}
+		arb_queue_talked = 1;
 		return xmit_len;
 	}
+	#endif /* USE_ARB_TRANSPORT */
 	else if (reg == 2)
 	{
 		xmit[0] = arb_buf2_high;
@@ -304,24 +821,142 @@ uint8_t arb_talk(uint8_t *xmit, uint8_t reg)
 	}
 }
 
-void arb_talk_drain(uint8_t reg)
+void arb_talk_drain(uint8_t inst, uint8_t reg)
 {
-	if (reg == 0)
+	(void) inst;
+	if (reg == 0 && arb_queue_talked)
 	{
-		// remove the data from arbitrary buffer 0
-		arb_buf0_len = 0;
-		arb_buf0_set = 0;
+		#ifdef USE_ARB_TRANSPORT
+			// sent, but kept until it's acknowledged
+			arb_queue_sent++;
+			if (arb_queue_sent > arb_queue_out)
+			{
+				arb_queue_out = arb_queue_sent;
+			}
+		#else
+			// remove the packet that was sent, exposing the next
+			arb_queue_head = (arb_queue_head + 1) & ARB_QUEUE_BITS;
+			arb_queue_count--;
+		#endif
+		arb_queue_talked = 0;
 	}
 }
 
-void arb_listen(uint8_t reg, uint16_t data)
+uint8_t arb_srq(uint8_t inst)
 {
+	(void) inst;
+	// needs servicing only if asked for it
+	return arb_queue_count;
+}
+
+void arb_flush(uint8_t inst)
+{
+	(void) inst;
+	#ifdef USE_ARB_TRANSPORT
+		arb_transport_reset();
+	#else
+		reset_arb_data(inst);
+	#endif
+}
+
+/*
+ * Listens to registers 0-2 are queued whole in arb_rx, as a header
+ * byte with the register in the upper 4 bits and the length in the
+ * lower 4, then the data.  If there isn't room for all of it, the
+ * packet is dropped.  Register 2 also keeps its first two bytes in
+ * arb_buf2_high/low for the nibble commands.
+ */
+void arb_listen(uint8_t inst, uint8_t reg, const uint8_t *data,
+		uint8_t len)
+{
+	(void) inst;
+	#ifdef USE_ARB_TRANSPORT
+		if (reg < 2)
+		{
+			arb_ack(data[0] & 0x0F);
+			// a header alone is only an acknowledgement, as on
+			// register 1; it has no data for arb_rx, where its empty
+			// packet couldn't be told from arb_rx being empty
+			if (len < 2) return;
+			
+			// only take the next packet in sequence, and only if it
+			// fits; the Mac sends it again otherwise
+			if (reg == 0 && (data[0] >> 4) == arb_rx_seq
+					&& FIFO_BITS - fifo_count(&arb_rx) >= len)
+			{
+				uint8_t i;
+				fifo_put(&arb_rx, len - 1);
+				for (i = 1; i < len; i++)
+				{
+					fifo_put(&arb_rx, data[i]);
+				}
+				arb_rx_seq = (arb_rx_seq + 1) & 0x0F;
+			}
+			else if (reg == 0)
+			{
+				STATS_BUMP(STAT_ARB_DROPPED);
+			}
+			return;
+		}
+	#endif /* USE_ARB_TRANSPORT */
+	
 	if (reg == 2)
 	{
-		arb_buf2_high = (data & 0xFF00) >> 8;
-		arb_buf2_low = data & 0xFF;
+		arb_buf2_high = data[0];
+		arb_buf2_low = data[1];
 		arb_buf2_set = 1;
 	}
+	
+	if (FIFO_BITS - fifo_count(&arb_rx) > len)
+	{
+		uint8_t i;
+		fifo_put(&arb_rx, (reg << 4) | len);
+		for (i = 0; i < len; i++)
+		{
+			fifo_put(&arb_rx, data[i]);
+		}
+	}
+	else
+	{
+		STATS_BUMP(STAT_ARB_DROPPED);
+	}
+}
+
+#ifdef USE_ARB_TRANSPORT
+/*
+ * Drops the queued packets the Mac has acknowledged, given the
+ * sequence number it expects next.  Acknowledgements for packets that
+ * haven't been sent are stale or bogus, and are ignored.
+ */
+static void arb_ack(uint8_t ack)
+{
+	uint8_t acked = (ack - arb_tx_seq) & 0x0F;
+	if (acked == 0 || acked > arb_queue_out) return;
+	
+	arb_queue_head = (arb_queue_head + acked) & ARB_QUEUE_BITS;
+	arb_queue_count -= acked;
+	arb_queue_out -= acked;
+	arb_queue_sent = arb_queue_sent > acked ? arb_queue_sent - acked : 0;
+	arb_tx_seq = ack;
+	arb_idle_polls = 0;
+}
+#endif /* USE_ARB_TRANSPORT */
+
+/*
+ * Takes the oldest packet out of arb_rx, copying up to 8 bytes of data
+ * into the given buffer.  Returns the packet's header byte, or zero if
+ * nothing was waiting.
+ */
+uint8_t arb_rx_pop(uint8_t *data)
+{
+	if (fifo_empty(&arb_rx)) return 0;
+	uint8_t header = fifo_get(&arb_rx);
+	uint8_t i;
+	for (i = 0; i < (header & 0x0F); i++)
+	{
+		data[i] = fifo_get(&arb_rx);
+	}
+	return header;
 }
 
 #endif /* USE_ARBITRARY */
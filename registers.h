@@ -19,7 +19,7 @@
 
 #pragma once
 
-#include <avr/io.h>
+#include "hal.h"
 
 /*
  * This file has all the register information that can be manipulated
@@ -32,10 +32,106 @@
  * the code carefully.
  */
 
-// bit masks for extracting individual devices from status vars
-#define ADB_KBD_FLAG_MASK 1
-#define ADB_MSE_FLAG_MASK 2
-#define ADB_ARB_FLAG_MASK 4
+/*
+ * Every device we emulate is described by an entry in adb_devices,
+ * which the ADB code works through rather than knowing about each type
+ * of device.  A device's slot in the table gives its bit in the packed
+ * target bytes passed around, and in the SRQ and collision masks.
+ * With KBD_COUNT or MSE_COUNT above 1, each keyboard or mouse has its
+ * own slot, and inst gives which one it is.
+ * 
+ * The hooks are the device's side of each bus operation, and are all
+ * given inst first:
+ * 
+ * talk: fills the buffer with the response for a register, returning
+ *     the length, or zero for no response.  Except for register 0,
+ *     this must only read, since the event engine calls it from an
+ *     interrupt that may land in the middle of anything else.
+ * drain: called once a talk response was sent in full.
+ * listen: given the bytes of a listen to register 0-2, may be NULL.
+ * srq: returns nonzero if the device needs servicing.  This is called
+ *     from device_changed(), see below.
+ * flush: for the ADB flush command.
+ * reset: restores the registers to their defaults.
+ * 
+ * srq_class is the device's priority class when several need
+ * servicing, lower first; see device_defer below.
+ * 
+ * Register 3 is handled entirely by the ADB code.  A listen may move
+ * the device to any address and select any of the handlers with a bit
+ * set in the handlers mask; the address and handler are set back to
+ * the values pointed to by init_addr and init_handler on a bus reset.
+ * Devices of the same type share these, so they all start out at the
+ * same address; only the first answers there until the host moves it
+ * away, as it does when enumerating several real devices of a type.
+ */
+struct adb_device
+{
+	uint8_t *addr;
+	uint8_t *handler;
+	const uint8_t *init_addr;
+	const uint8_t *init_handler;
+	uint8_t handlers;
+	uint8_t srq_class;
+	uint8_t (*talk)(uint8_t, uint8_t *, uint8_t);
+	void (*drain)(uint8_t, uint8_t);
+	void (*listen)(uint8_t, uint8_t, const uint8_t *, uint8_t);
+	uint8_t (*srq)(uint8_t);
+	void (*flush)(uint8_t);
+	void (*reset)(uint8_t);
+	uint8_t inst;
+};
+
+// slots of each device in the table
+#ifdef USE_KEYBOARD
+	#define ADB_KBD_SLOTS KBD_COUNT
+#else
+	#define ADB_KBD_SLOTS 0
+#endif
+#ifdef USE_MOUSE
+	#define ADB_MSE_SLOTS MSE_COUNT
+#else
+	#define ADB_MSE_SLOTS 0
+#endif
+#ifdef USE_ARBITRARY
+	#define ADB_ARB_SLOTS 1
+#else
+	#define ADB_ARB_SLOTS 0
+#endif
+#define ADB_KBD_DEVICE 0
+#define ADB_MSE_DEVICE (ADB_KBD_DEVICE + ADB_KBD_SLOTS)
+#define ADB_ARB_DEVICE (ADB_MSE_DEVICE + ADB_MSE_SLOTS)
+#define ADB_DEVICES (ADB_ARB_DEVICE + ADB_ARB_SLOTS)
+#if ADB_DEVICES > 8
+	#error "Too many devices for the packed target bytes"
+#endif
+
+// bit masks for extracting individual devices from status vars, the
+// keyboard and mouse ones given which of them
+#define ADB_KBD_FLAG_MASK(n) (1 << (ADB_KBD_DEVICE + (n)))
+#define ADB_MSE_FLAG_MASK(n) (1 << (ADB_MSE_DEVICE + (n)))
+#define ADB_ARB_FLAG_MASK (1 << ADB_ARB_DEVICE)
+
+/*
+ * The device table.  This is kept in RAM rather than flash so the
+ * hooks can be reached without extra loads during the stop bit.
+ */
+extern const struct adb_device adb_devices[ADB_DEVICES];
+/*
+ * Packed target byte of the device at each bus address, or 0 for
+ * none.  If two of our devices share an address, only the earlier
+ * one in the table answers there, so we never collide with ourselves.
+ */
+extern uint8_t adb_map[16];
+/*
+ * Rebuilds adb_map from the device addresses.  This must be called
+ * after any address changes.
+ */
+void device_map_update();
+/*
+ * Provides the table entry for the device in a packed target byte.
+ */
+const struct adb_device *device_lookup(uint8_t);
 
 /*
  * Resets the contents of all registers to the initial defaults.  This
@@ -43,18 +139,72 @@
  * the ADB bus resets from adb_reset().
  */
 void reset_registers();
-/*
- * Provides back a SRQ indicator, for showing which devices require
- * servicing at the time the call is made.  The reply byte matches
- * the flag masks defined earlier.  This must return promptly.
- */
-uint8_t devices_needing_srq();
 /*
  * Called whenever the ADB bus asks for a device to flush.  Given
  * the mask of the target being flushed.
  */
 void device_flush(uint8_t);
 
+/*
+ * Anything that could change what a device would send for register 0,
+ * or whether it needs servicing, must call device_changed() with its
+ * packed target byte once the change is made.
+ * 
+ * That keeps device_srq up to date, for showing which devices require
+ * servicing, with bits matching the flag masks defined earlier.  The
+ * stop bit reads it rather than asking each device.
+ * 
+ * Register 0 talk responses are built ahead of time by device_stage(),
+ * so a talk only has to copy one out.  Each device's response is kept
+ * in device_staged/device_staged_len by slot, and is up to date while
+ * the device's bit in device_stale is clear, which device_changed()
+ * sets.  The polled engine builds a stale one again for the talk; the
+ * event engine sends it as it is (see adb.c).  A flush or reset empties
+ * the device's copy.  Under the event engine, a device whose copy has
+ * been sent is in device_sending until the reply's drain is made, and
+ * is neither restaged nor answered meanwhile, and the one being
+ * restaged is in device_staging, and isn't answered either.
+ * 
+ * With USE_ARB_TRANSPORT the arbitrary device counts the polls it gets
+ * as they happen, so it is never staged and always built live.
+ * 
+ * The Mac decides which device it talks to, but we can steer it.  A
+ * device waiting while one in a more urgent class also waits is held
+ * back in device_defer: it raises no SRQ and gives no register 0
+ * reply, so the Mac's SRQ search passes over it.  device_starve counts
+ * how many times others were serviced while each device waited, and
+ * once it reaches SRQ_STARVE_LIMIT the device is no longer held back,
+ * so a busy keyboard can delay the others but never lock them out.
+ * device_srq only shows the devices not held back.
+ */
+#ifdef USE_ARB_TRANSPORT
+	#define ADB_STAGED_MASK (((1 << ADB_DEVICES) - 1) & ~ADB_ARB_FLAG_MASK)
+#else
+	#define ADB_STAGED_MASK ((1 << ADB_DEVICES) - 1)
+#endif
+extern uint8_t device_srq;
+extern uint8_t device_staged[ADB_DEVICES][8];
+extern uint8_t device_staged_len[ADB_DEVICES];
+extern uint8_t device_stale;
+extern volatile uint8_t device_sending;
+extern volatile uint8_t device_staging;
+extern uint8_t device_defer;
+extern uint8_t device_starve[ADB_DEVICES];
+void device_changed(uint8_t);
+/*
+ * Called when a register 0 reply from the given target was sent in
+ * full, before the device_changed() that follows, to update the
+ * starvation counts.
+ */
+void device_serviced(uint8_t);
+/*
+ * Rebuilds the staged response of one device that has changed, if any.
+ * It calls the device's talk hook, overwriting what a pending drain
+ * relies on, so devices in device_sending are skipped, and with the
+ * polled engine it must only be called between transactions.
+ */
+void device_stage();
+
 
 // and then the per-device registers
 
@@ -74,16 +224,23 @@ void device_flush(uint8_t);
 #define KBD_REG2_DEL_BIT 6
 
 // basic address/handlers
-extern uint8_t kbd_addr;
-extern uint8_t kbd_handler;
+extern uint8_t kbd_addr[KBD_COUNT];
+extern uint8_t kbd_handler[KBD_COUNT];
+extern uint8_t kbd_init_addr;
+extern uint8_t kbd_init_handler;
 // and the keyboard register stuff
-extern struct buffer kbd_buf;
-extern uint8_t kbd_reg2_low;
-extern uint8_t kbd_reg2_high;
-void reset_kbd_data();
-uint8_t kbd_talk(uint8_t *, uint8_t);
-void kbd_talk_drain(uint8_t);
-void kbd_listen(uint8_t, uint16_t);
+extern struct buffer kbd_buf[KBD_COUNT];
+extern uint8_t kbd_reg2_low[KBD_COUNT];
+extern uint8_t kbd_reg2_high[KBD_COUNT];
+void reset_kbd_data(uint8_t);
+/*
+ * Empties the key buffer for the serial side.  See mse_clear().
+ */
+void kbd_clear(uint8_t);
+uint8_t kbd_talk(uint8_t, uint8_t *, uint8_t);
+void kbd_talk_drain(uint8_t, uint8_t);
+void kbd_listen(uint8_t, uint8_t, const uint8_t *, uint8_t);
+uint8_t kbd_srq(uint8_t);
 
 #endif /* USE_KEYBOARD */
 
@@ -91,19 +248,63 @@ void kbd_listen(uint8_t, uint16_t);
 // --- MOUSE ---
 #ifdef USE_MOUSE
 
+/*
+ * Register 0 length when the host selects handler 4, the Apple Extended
+ * Mouse Protocol.  Handlers 1 and 2 send the standard 2 bytes.
+ */
+#define MSE_EXT_LEN 5
+
 // basic address/handlers
-extern uint8_t mse_addr;
-extern uint8_t mse_handler;
+extern uint8_t mse_addr[MSE_COUNT];
+extern uint8_t mse_handler[MSE_COUNT];
+extern uint8_t mse_init_addr;
 extern uint8_t mse_init_handler;
 // and the mouse register stuff
-extern uint8_t mse_btn_data;
-extern uint8_t mse_btn_reported;
-extern int16_t mse_x;
-extern int16_t mse_y;
-void reset_mse_data();
-uint8_t mse_talk(uint8_t *, uint8_t);
-void mse_talk_drain(uint8_t);
-void mse_listen(uint8_t, uint16_t);
+extern uint8_t mse_btn_data[MSE_COUNT];
+extern uint8_t mse_btn_reported[MSE_COUNT];
+extern int16_t mse_x[MSE_COUNT];
+extern int16_t mse_y[MSE_COUNT];
+void mse_move(uint8_t, int16_t, int16_t);
+/*
+ * Serial input keeps being handled while a reply is on the bus, so a
+ * register 0 talk keeps a copy of the report it built, and its drain
+ * takes exactly that off mse_x, mse_y and the reported buttons rather
+ * than whatever they hold by then.  Clears must go through here, so
+ * the drain of a report already built doesn't take back motion that
+ * was cleared; the same goes for kbd_clear().
+ */
+#define MSE_CLEAR_BTN 1
+#define MSE_CLEAR_X 2
+#define MSE_CLEAR_Y 4
+void mse_clear(uint8_t, uint8_t);
+#ifdef USE_MOUSE_SHAPING
+	/*
+	 * Motion waiting for the host is timed from when it arrived until
+	 * the host has taken all of it, and the host's polling rate is
+	 * measured while there is some, both in Timer1 ticks (0.5us).
+	 * 
+	 * The age is a count kept by mse_age_update(), which moves,
+	 * register 0 talks and drains all call; it must be called more
+	 * often than Timer1 wraps (32ms) while motion waits, which the
+	 * host's polling sees to.  The count saturates at MSE_AGE_MAX.
+	 * 
+	 * A move too big for one standard report keeps its direction if,
+	 * at the measured rate, the host takes it all within
+	 * MSE_SHAPE_WINDOW, one 60Hz frame.  Otherwise it is sent as the
+	 * baseline does, with each axis clamped on its own, which gets it
+	 * there soonest.
+	 */
+	#define MSE_AGE_MAX 0x7FFF
+	#define MSE_SHAPE_WINDOW 33333
+	extern uint16_t mse_poll_interval[MSE_COUNT];
+	void mse_age_update(uint8_t);
+	uint8_t mse_backlog(uint8_t);
+	uint16_t mse_backlog_age(uint8_t);
+#endif
+void reset_mse_data(uint8_t);
+uint8_t mse_talk(uint8_t, uint8_t *, uint8_t);
+void mse_talk_drain(uint8_t, uint8_t);
+uint8_t mse_srq(uint8_t);
 
 #endif /* USE_MOUSE */
 
@@ -111,22 +312,69 @@ void mse_listen(uint8_t, uint16_t);
 // --- ARBITRARY DEVICE ---
 #ifdef USE_ARBITRARY
 
+#include "fifo.h"
+
 // basic address/handlers
 #define ARB_BUF0_SIZE 8
+#define ARB_QUEUE_SIZE 4 // must be power of 2
+#define ARB_QUEUE_BITS (ARB_QUEUE_SIZE - 1)
 extern uint8_t arb_addr;
 extern uint8_t arb_handler;
 extern uint8_t arb_init_addr;
 extern uint8_t arb_init_handler;
-// and the arbitrary registers
+// and the arbitrary registers.  register 0 data is staged in arb_buf0,
+// then queued to be sent by talks in order
 extern uint8_t arb_buf0[ARB_BUF0_SIZE];
 extern uint8_t arb_buf0_len;
-extern uint8_t arb_buf0_set;
+extern uint8_t arb_queue_count;
 extern uint8_t arb_buf2_low;
 extern uint8_t arb_buf2_high;
 extern uint8_t arb_buf2_set;
-void reset_arb_data();
-uint8_t arb_talk(uint8_t *, uint8_t);
-void arb_talk_drain(uint8_t);
-void arb_listen(uint8_t, uint16_t);
+// packets received by listens to registers 0-2, for the serial side
+extern struct fifo arb_rx;
+
+/*
+ * With USE_ARB_TRANSPORT, register 0 carries a sequenced go-back-N
+ * transport in both directions.  The first byte of every packet is a
+ * header: the packet's sequence number in the upper 4 bits, and the
+ * sequence number the sender expects next from the other side (the
+ * acknowledgement) in the lower 4.  Up to 7 data bytes follow.
+ * 
+ * Towards the Mac, talks send the queued packets in order without
+ * waiting, up to ARB_QUEUE_SIZE in flight.  A packet leaves the queue
+ * only once it's acknowledged; SRQ stays up until then, and if the
+ * Mac polls ARB_RESEND_POLLS times with nothing new to send, every
+ * unacknowledged packet is sent again.
+ * 
+ * From the Mac, a listen to register 0 with the next expected
+ * sequence number is passed to arb_rx (minus the header) if there is
+ * room; anything else is dropped, to be sent again.  A listen to
+ * register 1, or one to register 0 with no data after the header, only
+ * carries an acknowledgement.  Talking register 1
+ * gives the current sequence numbers in the same format as a header,
+ * then how many bytes are free in arb_rx.
+ * 
+ * An ADB flush restarts both sequences from zero without losing any
+ * queued data, which is sent again.
+ */
+#ifdef USE_ARB_TRANSPORT
+	#define ARB_RESEND_POLLS 2
+	// bounds on a queued packet, leaving room for the header
+	#define ARB_PACKET_MIN 1
+	#define ARB_PACKET_MAX (ARB_BUF0_SIZE - 1)
+	void arb_transport_reset();
+#else
+	#define ARB_PACKET_MIN 2
+	#define ARB_PACKET_MAX ARB_BUF0_SIZE
+#endif
+void reset_arb_data(uint8_t);
+uint8_t arb_queue_push();
+void arb_queue_clear();
+uint8_t arb_talk(uint8_t, uint8_t *, uint8_t);
+void arb_talk_drain(uint8_t, uint8_t);
+void arb_listen(uint8_t, uint8_t, const uint8_t *, uint8_t);
+uint8_t arb_srq(uint8_t);
+void arb_flush(uint8_t);
+uint8_t arb_rx_pop(uint8_t *);
 
 #endif /* USE_ARBITRARY */
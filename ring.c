@@ -18,6 +18,7 @@
  */
 
 #include "ring.h"
+#include "stats.h"
 
 #if USE_KEYBOARD
 
@@ -33,6 +34,10 @@ void ring_buffer_add(struct buffer *buf, uint8_t v)
 	{
 		rb_add_raw(buf, v);
 	}
+	else
+	{
+		STATS_BUMP(STAT_KEYS_DROPPED);
+	}
 }
 
 /*
@@ -53,6 +58,10 @@ void ring_buffer_add_dual(struct buffer *buf, uint8_t v, uint8_t u)
 			rb_add_raw(buf, v);
 			rb_add_raw(buf, u);
 		}
+		else
+		{
+			STATS_BUMP(STAT_KEYS_DROPPED);
+		}
 	}
 	else
 	{
@@ -62,6 +71,10 @@ void ring_buffer_add_dual(struct buffer *buf, uint8_t v, uint8_t u)
 			rb_add_raw(buf, v);
 			rb_add_raw(buf, u);
 		}
+		else
+		{
+			STATS_BUMP(STAT_KEYS_DROPPED);
+		}
 	}
 }
 
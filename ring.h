@@ -29,7 +29,7 @@
 
 #pragma once
 
-#include <avr/io.h>
+#include "hal.h"
 
 #ifdef USE_KEYBOARD
 
@@ -18,21 +18,143 @@
  */
 
 #include "serial.h"
-
-#ifdef USE_USART
-	#define BAUD 38400
-	#include <util/setbaud.h>
-#endif
+#include "profile.h"
+#include "stats.h"
 
 #ifdef USE_KEYBOARD
 	static void handle_keyboard_data(uint8_t kc);
 	static uint8_t kbd_temp = 0;
+	// the keyboard that keycodes go to, see nibble_select()
+	static uint8_t serial_kbd = 0;
+#endif
+#ifdef USE_MOUSE
+	// and the mouse that motion and buttons go to
+	static uint8_t serial_mse = 0;
 #endif
 
 #ifdef USE_ARBITRARY
 	static uint8_t arb_buf0_tmp = 0;
 #endif
 
+#ifdef USE_USART_RX_IRQ
+	#ifndef USE_USART
+		#error "USE_USART_RX_IRQ requires USE_USART"
+	#endif
+	#include "fifo.h"
+	// bytes received by the interrupt, waiting for handle_data()
+	static struct fifo serial_rx;
+#endif
+
+#ifdef USE_USART_TX_IRQ
+	#ifndef USE_USART
+		#error "USE_USART_TX_IRQ requires USE_USART"
+	#endif
+	#include "fifo.h"
+	// bytes waiting for the transmit interrupt, and the most that have
+	// been waiting at once since the host last asked
+	static struct fifo serial_tx;
+	static uint8_t serial_tx_peak = 0;
+#endif
+
+// the prefix command whose argument bytes are being collected, if
+// any, see 0x09 and 0x0A
+static uint8_t serial_prefix = 0;
+static uint8_t serial_args[3];
+static uint8_t serial_arg_len = 0;
+static uint8_t handle_prefix(uint8_t);
+static inline void poll_data() __attribute__((always_inline));
+#ifdef USE_USART
+	static uint8_t handle_query(uint8_t);
+#endif
+static uint8_t handle_nibble(uint8_t);
+
+// nibble protocol commands, called with the whole byte and giving the
+// reply, by the upper nibble
+typedef uint8_t (*nibble_handler)(uint8_t);
+#if ! defined(USE_ARBITRARY) || ! defined(USE_KEYBOARD) \
+		|| ! defined(USE_MOUSE)
+	static uint8_t nibble_reserved(uint8_t);
+#endif
+static uint8_t nibble_special(uint8_t);
+#if defined(USE_KEYBOARD) || defined(USE_MOUSE)
+	static uint8_t nibble_select(uint8_t);
+	#define NIBBLE_SELECT nibble_select
+#else
+	#define NIBBLE_SELECT nibble_reserved
+#endif
+#ifdef USE_ARBITRARY
+	static uint8_t nibble_arb_low(uint8_t);
+	static uint8_t nibble_arb_high(uint8_t);
+	#define NIBBLE_ARB_LOW nibble_arb_low
+	#define NIBBLE_ARB_HIGH nibble_arb_high
+#else
+	#define NIBBLE_ARB_LOW nibble_reserved
+	#define NIBBLE_ARB_HIGH nibble_reserved
+#endif
+#ifdef USE_KEYBOARD
+	static uint8_t nibble_kbd_low(uint8_t);
+	static uint8_t nibble_kbd_high(uint8_t);
+	#define NIBBLE_KBD_LOW nibble_kbd_low
+	#define NIBBLE_KBD_HIGH nibble_kbd_high
+#else
+	#define NIBBLE_KBD_LOW nibble_reserved
+	#define NIBBLE_KBD_HIGH nibble_reserved
+#endif
+#ifdef USE_MOUSE
+	static uint8_t nibble_btn_low(uint8_t);
+	static uint8_t nibble_btn_high(uint8_t);
+	static uint8_t nibble_motion(uint8_t);
+	#define NIBBLE_BTN_LOW nibble_btn_low
+	#define NIBBLE_BTN_HIGH nibble_btn_high
+	#define NIBBLE_MOTION nibble_motion
+#else
+	#define NIBBLE_BTN_LOW nibble_reserved
+	#define NIBBLE_BTN_HIGH nibble_reserved
+	#define NIBBLE_MOTION nibble_reserved
+#endif
+static const nibble_handler nibble_handlers[16] HAL_FLASH = {
+	nibble_special, // 0x0X special commands
+	NIBBLE_SELECT, // 0x1X keyboard or mouse selection
+	NIBBLE_ARB_LOW, // 0x2X arbitrary register 0, lower nibble
+	NIBBLE_ARB_HIGH, // 0x3X and upper nibble, storing the byte
+	NIBBLE_KBD_LOW, // 0x4X keycode, lower nibble
+	NIBBLE_KBD_HIGH, // 0x5X and upper nibble, pushing the key
+	NIBBLE_BTN_LOW, // 0x6X mouse buttons, lower nibble
+	NIBBLE_BTN_HIGH, // 0x7X and upper nibble
+	NIBBLE_MOTION, // 0x8X +X
+	NIBBLE_MOTION, // 0x9X -X
+	NIBBLE_MOTION, // 0xAX +X << 4
+	NIBBLE_MOTION, // 0xBX -X << 4
+	NIBBLE_MOTION, // 0xCX +Y
+	NIBBLE_MOTION, // 0xDX -Y
+	NIBBLE_MOTION, // 0xEX +Y << 4
+	NIBBLE_MOTION // 0xFX -Y << 4
+};
+#ifdef USE_MOUSE
+	static void handle_mouse_report(int8_t, int8_t, uint8_t);
+#endif
+
+#ifdef USE_FRAMED
+	// framed protocol v2, see handle_frame()
+	#define FRAME_PAYLOAD_MAX 8
+	// single key bytes: down, then up, for keycodes 0x00-0x57
+	#define FRAME_KEY_DOWN 0x40
+	#define FRAME_KEY_UP 0x98
+	#define FRAME_KEY_END 0xF0
+	// and the escape for any keycode, given in the byte after it
+	#define FRAME_KEY_ESCAPE 0xF1
+	// Timer1 ticks without input before a partial frame is dropped,
+	// 20ms, well short of a wrap
+	#define FRAME_IDLE_TICKS 40000
+	static uint8_t framed = 0;
+	static uint8_t frame[FRAME_PAYLOAD_MAX + 2];
+	static uint8_t frame_len = 0;
+	static uint16_t frame_time;
+	static uint8_t handle_frame(uint8_t);
+	static uint8_t frame_length_ok(uint8_t, uint8_t);
+	static void frame_execute(uint8_t, const uint8_t *, uint8_t);
+#endif
+
 
 // --- methods ---
 
@@ -40,42 +162,59 @@ void init_data()
 {
 	#ifdef USE_USART
 		// setup USART for the data connection
-		UBRR0H = UBRRH_VALUE;
-		UBRR0L = UBRRL_VALUE;
-		#if USE_2X
-			UCSR0A |= (1 << U2X0);
-		#else
-			UCSR0A &= ~(1 << U2X0);
+		HAL_USART_INIT();
+		#ifdef USE_USART_RX_IRQ
+			HAL_USART_RX_IRQ_ENABLE();
+		#endif
+		#if defined(USE_USART_RX_IRQ) || defined(USE_USART_TX_IRQ)
+			// the transmit interrupt is only armed as data is queued,
+			// but needs interrupts on all the same
+			HAL_IRQ_ENABLE();
 		#endif
-		// and enable
-		UCSR0B = _BV(RXEN0) | _BV(TXEN0);
 	
 	#else /* ! USE_USART */
 		// SPI enable instead
-		USICR |= _BV(USIWM0) | _BV(USICS1);
+		HAL_SPI_INIT();
 	#endif /* USE_USART */
 }
 
 void handle_data()
+{
+	PROFILE_BEGIN(t);
+	poll_data();
+	PROFILE_END(PROFILE_HANDLE_DATA, t);
+}
+
+/*
+ * The body of handle_data(), kept apart so it can be timed as a whole.
+ */
+static inline void poll_data()
 {
 	// --- use USI ---
 	#ifndef USE_USART
 		// is there a new byte? if not, nothing to do here
-		if (!(USISR & _BV(USIOIF))) return;
+		if (! HAL_SPI_RX_READY()) return;
 		// read the buffer contents, clear the data flag, and process
-		uint8_t serial = USIBR;
-		USISR |= _BV(USIOIF);
-		USIDR = handle_serial_data(serial);
+		uint8_t serial = HAL_SPI_READ();
+		HAL_SPI_ACK();
+		HAL_SPI_WRITE(handle_serial_data(serial));
 		
 	// --- use USART ---
 	#else
-		if (!(UCSR0A & _BV(RXC0))) return;
-		uint8_t serial = UDR0;
+		#ifdef USE_USART_RX_IRQ
+			// bytes were already pulled off the USART by the
+			// interrupt, process the oldest one
+			if (fifo_empty(&serial_rx)) return;
+			uint8_t serial = fifo_get(&serial_rx);
+		#else
+			if (! HAL_USART_RX_READY()) return;
+			uint8_t serial = HAL_USART_READ();
+		#endif /* USE_USART_RX_IRQ */
 		#ifndef DEBUG_MODE
 			uint8_t response = handle_serial_data(serial);
 			if (response > 0)
 			{
-				UDR0 = response;
+				send_data(response);
 			}
 		#else
 			handle_serial_data(serial);
@@ -84,338 +223,695 @@ void handle_data()
 	#endif /* USE_USART */
 }
 
+void send_data(uint8_t v)
+{
+	#ifndef USE_USART
+		HAL_SPI_WRITE(v);
+	#elif defined(USE_USART_TX_IRQ)
+		// queue first, then make sure the interrupt is on to send it
+		fifo_put(&serial_tx, v);
+		uint8_t depth = fifo_count(&serial_tx);
+		if (depth > serial_tx_peak) serial_tx_peak = depth;
+		HAL_USART_TX_IRQ_ENABLE();
+	#else
+		// wait for room rather than write over a byte still going
+		// out; a query reply holds up the main loop for as long as it
+		// takes to send, which USE_USART_TX_IRQ avoids
+		while (! HAL_USART_TX_READY());
+		HAL_USART_WRITE(v);
+	#endif
+}
+
+#ifdef USE_USART_TX_IRQ
+/*
+ * Feeds the next queued byte to the USART whenever its data register
+ * is free, and switches itself off once the queue is empty.
+ */
+HAL_ISR(USART_UDRE)
+{
+	if (fifo_empty(&serial_tx))
+	{
+		HAL_USART_TX_IRQ_DISABLE();
+	}
+	else
+	{
+		HAL_USART_WRITE(fifo_get(&serial_tx));
+	}
+}
+#endif /* USE_USART_TX_IRQ */
+
+#ifdef USE_USART_RX_IRQ
+/*
+ * Moves each received byte into the FIFO as soon as it arrives, so
+ * the 2 byte hardware buffer can't overrun no matter how long it has
+ * been since handle_data() last ran.  If the FIFO itself fills, the
+ * byte is dropped.  This is kept short since it delays whatever ADB
+ * timing loop it interrupts.
+ */
+HAL_ISR(USART_RX)
+{
+	fifo_put(&serial_rx, HAL_USART_READ());
+}
+#endif /* USE_USART_RX_IRQ */
+
 uint8_t handle_serial_data(uint8_t spi)
 {
-	// the upper 4 bits of SPI byte control flow
-	uint8_t cmd = spi >> 4;
-	// and the lower 4 are the data bits
-	uint8_t payload = spi & 0x0F;
+	PROFILE_BEGIN(t);
+	uint8_t response;
+	#ifdef USE_FRAMED
+	if (framed)
+	{
+		response = handle_frame(spi);
+	}
+	else
+	#endif
+	{
+		response = handle_nibble(spi);
+	}
+	PROFILE_END(PROFILE_SERIAL_DATA, t);
+	return response;
+}
+
+/*
+ * The original protocol, where each byte is a 4 bit command and 4 bits
+ * of data.
+ */
+static uint8_t handle_nibble(uint8_t spi)
+{
+	// the bytes after a prefix command are its arguments
+	if (serial_prefix)
+	{
+		return handle_prefix(spi);
+	}
 	
+	// the upper 4 bits of SPI byte pick the command
+	nibble_handler handler = HAL_FLASH_FUNC(nibble_handler,
+			&nibble_handlers[spi >> 4]);
+	return handler(spi);
+}
+
+#if ! defined(USE_ARBITRARY) || ! defined(USE_KEYBOARD) \
+		|| ! defined(USE_MOUSE)
+static uint8_t nibble_reserved(uint8_t spi)
+{
+	(void) spi;
+	return 0;
+}
+#endif
+
+/*
+ * Special commands, in the 0x0-0xF range.
+ */
+static uint8_t nibble_special(uint8_t spi)
+{
 	// status reporting variable, to be used later
 	uint8_t status;
+	uint8_t payload = spi & 0x0F;
 	
-	// do keyboard upper bits first, as they have the largest
-	// performance issues
-	#ifdef USE_KEYBOARD
-	if (cmd == 5)
-	{
-		// keyboard upper nibble, push
-		uint8_t kc = (payload << 4) + kbd_temp;
-		handle_keyboard_data(kc);
-	}
-	#endif /* USE_KEYBOARD */
-	
-	// route to the correct code
-	if (cmd < 4)
+	switch(payload)
 	{
-		if (cmd == 0)
-		{
-			// special commands, in the 0x0-0xF range
-			switch(payload)
-			{
-			case 0x01: // TALK STATUS
-				status = 0x80;
-				#ifdef USE_ARBITRARY
-				if (arb_buf2_set)
-				{
-					status |= _BV(3);
-				}
-				if (arb_buf0_set)
-				{
-					status |= _BV(2);
-				}
-				#endif /* USE_ARBITRARY */
-				#ifdef USE_KEYBOARD
-				if (ring_buffer_size(&kbd_buf) > RING_BUFFER_HALF_SIZE)
-				{
-					status |= _BV(0);
-				}
-				#endif /* USE_KEYBOARD */
-				return status;
-			#ifdef USE_ARBITRARY
-			case 0x02: // ARBITRARY REGISTER 0 READY
-				if (arb_buf0_len >= 2)
-				{
-					arb_buf0_set = 1;
-				}
-				break;
-			case 0x03: // ARBITRARY CLEAR REGISTER 0
-				arb_buf0_len = 0;
-				arb_buf0_set = 0;
-				break;
-			case 0x04: // ARBITRARY REGISTER 2 CLEAR
-				arb_buf2_high = 0;
-				arb_buf2_low = 0;
-				arb_buf2_set = 0;
-				break;
-			#endif /* USE_ARBITRARY */
-			#ifdef USE_KEYBOARD
-			case 0x05: // KEYBOARD CLEAR REGISTER 0
-				ring_buffer_clear(&kbd_buf);
-				break;
-			#endif /* USE_KEYBOARD */
-			#ifdef USE_MOUSE
-			case 0x06: // MOUSE CLEAR BUTTONS
-				mse_btn_data = 0x00;
-				break;
-			case 0x07: // MOUSE CLEAR X MOTION
-				mse_x = 0;
-				break;
-			case 0x08: // MOUSE CLEAR Y MOTION
-				mse_y = 0;
-				break;
-			#endif /* USE_MOUSE */
-			#ifdef USE_ARBITRARY
-			case 0x0C: // TALK ARBITRARY REGISTER 2 BYTE 0 LOWER NIBBLE
-				return 0x40 + (arb_buf2_low & 0x0F);
-			case 0x0D: // TALK ARBITRARY REGISTER 2 BYTE 0 UPPER NIBBLE
-				return 0x50 + ((arb_buf2_low & 0xF0) >> 4);
-			case 0x0E: // TALK ARBITRARY REGISTER 2 BYTE 1 LOWER NIBBLE
-				return 0x60 + (arb_buf2_high & 0x0F);
-			case 0x0F: // TALK ARBITRARY REGISTER 2 BYTE 1 UPPER NIBBLE
-				return 0x70 + ((arb_buf2_high & 0xF0) >> 4);
-			#endif /* USE_ARBITRARY */
-			default: // all others reserved
-				break;
-			}
-		}
+	case 0x01: // TALK STATUS
+		status = 0x80;
 		#ifdef USE_ARBITRARY
-		else if (cmd == 2)
+		if (arb_buf2_set)
 		{
-			// arbitrary device register 0 lower nibble
-			arb_buf0_tmp = payload;
+			status |= _BV(3);
 		}
-		else if (cmd == 3)
+		// listen data waiting, see query 0x01
+		if (! fifo_empty(&arb_rx))
 		{
-			// and the upper nibble + update
-			// drop if no space remaining
-			if (arb_buf0_len < ARB_BUF0_SIZE)
-			{
-				arb_buf0[arb_buf0_len++] = (payload << 4) + arb_buf0_tmp;
-			}
-			// clear temp regardless
-			arb_buf0_tmp = 0;
+			status |= _BV(1);
 		}
-		#endif /* USE_ARBITRARY */
-	}
-	else if (cmd < 8)
-	{
-		if (cmd < 6)
+		// no room to queue more register 0 data
+		if (arb_queue_count >= ARB_QUEUE_SIZE)
 		{
-			#ifdef USE_KEYBOARD
-			// command 4 only, 5 was handled earlier
-			// keyboard lower nibble, update lower nibble temp
-			kbd_temp = payload;
-			#endif /* USE_KEYBOARD */
+			status |= _BV(2);
 		}
-		else
+		#endif /* USE_ARBITRARY */
+		#ifdef USE_KEYBOARD
+		if (ring_buffer_size(&kbd_buf[serial_kbd])
+				> RING_BUFFER_HALF_SIZE)
 		{
-			#ifdef USE_MOUSE
-			
-			if (cmd == 6)
-			{
-				// set mouse buttons, lower nibble
-				uint8_t new_mse_btn_data = payload;
-				new_mse_btn_data |= mse_btn_data & 0xF0;
-				mse_btn_data = new_mse_btn_data;
-			}
-			else
-			{
-				// set mouse buttons, upper nibble
-				uint8_t new_mse_btn_data = payload << 4;
-				new_mse_btn_data |= mse_btn_data & 0x0F;
-				mse_btn_data = new_mse_btn_data;
-			}
-			
-			#endif /* USE_MOUSE */
+			status |= _BV(0);
 		}
+		#endif /* USE_KEYBOARD */
+		return status;
+	#ifdef USE_ARBITRARY
+	case 0x02: // ARBITRARY REGISTER 0 READY, queue staged data
+		arb_queue_push();
+		break;
+	case 0x03: // ARBITRARY CLEAR REGISTER 0, staged and queued
+		arb_buf0_len = 0;
+		arb_queue_clear();
+		break;
+	case 0x04: // ARBITRARY REGISTER 2 CLEAR
+		arb_buf2_high = 0;
+		arb_buf2_low = 0;
+		arb_buf2_set = 0;
+		break;
+	#endif /* USE_ARBITRARY */
+	#ifdef USE_KEYBOARD
+	case 0x05: // KEYBOARD CLEAR REGISTER 0
+		kbd_clear(serial_kbd);
+		break;
+	#endif /* USE_KEYBOARD */
+	#ifdef USE_MOUSE
+	case 0x06: // MOUSE CLEAR BUTTONS
+		mse_clear(serial_mse, MSE_CLEAR_BTN);
+		break;
+	case 0x07: // MOUSE CLEAR X MOTION
+		mse_clear(serial_mse, MSE_CLEAR_X);
+		break;
+	case 0x08: // MOUSE CLEAR Y MOTION
+		mse_clear(serial_mse, MSE_CLEAR_Y);
+		break;
+	#endif /* USE_MOUSE */
+	#ifdef USE_MOUSE
+	case 0x09: // MOUSE REPORT, next 3 bytes are X, Y, buttons
+	#endif /* USE_MOUSE */
+	#ifdef USE_USART
+	case 0x0A: // QUERY, next byte selects what to report
+		serial_prefix = payload;
+		serial_arg_len = 0;
+		break;
+	#endif /* USE_USART */
+	#ifdef USE_FRAMED
+	case 0x0B: // FRAMED MODE, see handle_frame()
+		framed = 1;
+		frame_len = 0;
+		break;
+	#endif /* USE_FRAMED */
+	#ifdef USE_ARBITRARY
+	case 0x0C: // TALK ARBITRARY REGISTER 2 BYTE 0 LOWER NIBBLE
+		return 0x40 + (arb_buf2_low & 0x0F);
+	case 0x0D: // TALK ARBITRARY REGISTER 2 BYTE 0 UPPER NIBBLE
+		return 0x50 + ((arb_buf2_low & 0xF0) >> 4);
+	case 0x0E: // TALK ARBITRARY REGISTER 2 BYTE 1 LOWER NIBBLE
+		return 0x60 + (arb_buf2_high & 0x0F);
+	case 0x0F: // TALK ARBITRARY REGISTER 2 BYTE 1 UPPER NIBBLE
+		return 0x70 + ((arb_buf2_high & 0xF0) >> 4);
+	#endif /* USE_ARBITRARY */
+	default: // all others reserved
+		break;
 	}
-	else
+	return 0;
+}
+
+#if defined(USE_KEYBOARD) || defined(USE_MOUSE)
+/*
+ * Picks which keyboard (0x10-0x13) or mouse (0x18-0x1B) the commands
+ * that follow apply to, when there is more than one.  Ones that don't
+ * exist are ignored.
+ */
+static uint8_t nibble_select(uint8_t spi)
+{
+	uint8_t n = spi & 0x07;
+	if (spi & 0x08)
 	{
 		#ifdef USE_MOUSE
-		
-		uint8_t high_bits = (cmd & 2) >> 1;
-		uint8_t positive = ! (cmd & 1);
-		
-		if (cmd < 12)
-		{
-			// x motion
-			if (positive)
-			{
-				if (high_bits)
-				{
-					mse_x += payload << 4;
-				}
-				else
-				{
-					mse_x += payload;
-				}
-			}
-			else
-			{
-				if (high_bits)
-				{
-					mse_x -= payload << 4;
-				}
-				else
-				{
-					mse_x -= payload;
-				}
-			}
-		}
-		else
-		{
-			// y motion
-			if (positive)
-			{
-				if (high_bits)
-				{
-					mse_y += payload << 4;
-				}
-				else
-				{
-					mse_y += payload;
-				}
-			}
-			else
-			{
-				if (high_bits)
-				{
-					mse_y -= payload << 4;
-				}
-				else
-				{
-					mse_y -= payload;
-				}
-			}
-		}
-		
-		#endif /* USE_MOUSE */
+			if (n < MSE_COUNT) serial_mse = n;
+		#endif
+	}
+	else
+	{
+		#ifdef USE_KEYBOARD
+			if (n < KBD_COUNT) serial_kbd = n;
+		#endif
 	}
-	
-	// catch-all return indicating no data
 	return 0;
 }
+#endif
+
+#ifdef USE_ARBITRARY
+static uint8_t nibble_arb_low(uint8_t spi)
+{
+	// arbitrary device register 0 lower nibble
+	arb_buf0_tmp = spi & 0x0F;
+	return 0;
+}
+
+static uint8_t nibble_arb_high(uint8_t spi)
+{
+	// and the upper nibble + update
+	// drop if no space remaining
+	if (arb_buf0_len < ARB_PACKET_MAX)
+	{
+		arb_buf0[arb_buf0_len++] = (spi << 4) + arb_buf0_tmp;
+	}
+	// clear temp regardless
+	arb_buf0_tmp = 0;
+	return 0;
+}
+#endif /* USE_ARBITRARY */
 
 #ifdef USE_KEYBOARD
+static uint8_t nibble_kbd_low(uint8_t spi)
+{
+	// keyboard lower nibble, update lower nibble temp
+	kbd_temp = spi & 0x0F;
+	return 0;
+}
+
+static uint8_t nibble_kbd_high(uint8_t spi)
+{
+	// keyboard upper nibble, push
+	handle_keyboard_data((spi << 4) + kbd_temp);
+	return 0;
+}
+#endif /* USE_KEYBOARD */
+
+#ifdef USE_MOUSE
+static uint8_t nibble_btn_low(uint8_t spi)
+{
+	// set mouse buttons, lower nibble
+	uint8_t *btn = &mse_btn_data[serial_mse];
+	*btn = (*btn & 0xF0) | (spi & 0x0F);
+	device_changed(ADB_MSE_FLAG_MASK(serial_mse));
+	return 0;
+}
+
+static uint8_t nibble_btn_high(uint8_t spi)
+{
+	// set mouse buttons, upper nibble
+	uint8_t *btn = &mse_btn_data[serial_mse];
+	*btn = (*btn & 0x0F) | (spi << 4);
+	device_changed(ADB_MSE_FLAG_MASK(serial_mse));
+	return 0;
+}
+
 /*
- * Takes a given keycode and applies it to both the keyboard buffer and
- * the relevant bits of register 2.
+ * Mouse motion, commands 0x8-0xF.  Of the command bits, the lowest
+ * gives the sign, the next whether the payload is the upper nibble,
+ * and the top one picks Y over X.
  */
-static void handle_keyboard_data(uint8_t kc)
+static uint8_t nibble_motion(uint8_t spi)
 {
-	uint8_t up = kc >> 7; // flag for up or down
-	uint8_t key = kc & 0x7F; // and the key to test
+	int16_t d = spi & 0x0F;
+	if (spi & 0x20) d <<= 4;
+	if (spi & 0x10) d = -d;
 	
-	// there is special handling for the power key
-	if (key == 0x7F)
+	if (spi & 0x40)
 	{
-		// add command and set the relevant flag
-		ring_buffer_add_dual(&kbd_buf, kc, kc);
-		if(up)
-		{
-			kbd_reg2_high &= ~_BV(KBD_REG2_RST_BIT);
-		}
-		else
-		{
-			kbd_reg2_high |= _BV(KBD_REG2_RST_BIT);
-		}
-		
-		// then we're done
-		return;
+		mse_move(serial_mse, 0, d);
 	}
+	else
+	{
+		mse_move(serial_mse, d, 0);
+	}
+	return 0;
+}
+#endif /* USE_MOUSE */
+
+/*
+ * Collects the argument bytes of a prefix command, running it once
+ * they have all arrived.
+ */
+static uint8_t handle_prefix(uint8_t v)
+{
+	uint8_t prefix = serial_prefix;
+	serial_args[serial_arg_len++] = v;
+	#ifdef USE_MOUSE
+		if (prefix == 0x09 && serial_arg_len < 3) return 0;
+	#endif
+	serial_prefix = 0;
 	
-	// keyboard upper nibble, push into buffer with previous 
-	// low nibble and reset the lower nibble temporary value
-	ring_buffer_add(&kbd_buf, kc);
-	kbd_temp = 0;
-				
-	// update register 2 flags information with keys
-	switch (key)
+	switch (prefix)
 	{
-	case 0x71: // scroll lock
-		if (up)
-		{
-			kbd_reg2_low &= ~_BV(KBD_REG2_SCRL_BIT);
-		}
-		else
-		{
-			kbd_reg2_low |= _BV(KBD_REG2_SCRL_BIT);
-		}
+	#ifdef USE_MOUSE
+	case 0x09:
+		handle_mouse_report(serial_args[0], serial_args[1],
+				serial_args[2]);
 		break;
-	case 0x47: // num lock
-		if (up)
-		{
-			kbd_reg2_low &= ~_BV(KBD_REG2_NUML_BIT);
-		}
-		else
+	#endif /* USE_MOUSE */
+	#ifdef USE_USART
+	case 0x0A:
+		return handle_query(v);
+	#endif /* USE_USART */
+	}
+	return 0;
+}
+
+#ifdef USE_MOUSE
+/*
+ * Applies a whole mouse report at once: signed X and Y motion added to
+ * what is pending, and the new button byte.  Since nothing is changed
+ * until the report is complete, a talk can never see X applied
+ * without Y.
+ */
+static void handle_mouse_report(int8_t x, int8_t y, uint8_t buttons)
+{
+	mse_btn_data[serial_mse] = buttons;
+	mse_move(serial_mse, x, y);
+}
+#endif /* USE_MOUSE */
+
+#ifdef USE_USART
+/*
+ * Handles the byte following a 0x0A QUERY command.  Replies go out
+ * with send_data() since they can be more than one byte, so this is
+ * USART only; over SPI, a reply can only be the one byte the host
+ * clocks out with its next command.
+ */
+static uint8_t handle_query(uint8_t query)
+{
+	switch (query)
+	{
+	#ifdef USE_USART_TX_IRQ
+	case 0x00: // SERIAL TRANSMIT QUEUE DEPTH, now and peak since last
+		send_data(fifo_count(&serial_tx));
+		send_data(serial_tx_peak);
+		serial_tx_peak = 0;
+		break;
+	#endif /* USE_USART_TX_IRQ */
+	#ifdef USE_ARBITRARY
+	case 0x01: // ARBITRARY RECEIVE, oldest listen packet
 		{
-			kbd_reg2_low |= _BV(KBD_REG2_NUML_BIT);
+			// the header (register and length) then the data, or
+			// just 0x00 if there is nothing waiting
+			uint8_t data[8];
+			uint8_t header = arb_rx_pop(data);
+			uint8_t i;
+			send_data(header);
+			for (i = 0; i < (header & 0x0F); i++)
+			{
+				send_data(data[i]);
+			}
 		}
 		break;
-	case 0x37: // command
-		if (up)
+	#endif /* USE_ARBITRARY */
+	#ifdef USE_MOUSE_SHAPING
+	case 0x02: // MOUSE BACKLOG
+	{
+		// reports needed to send the pending motion, how long it has
+		// waited, and the host's measured poll interval, the last two
+		// in 64us units (saturating at 0xFF)
+		uint16_t interval = mse_poll_interval[serial_mse] >> 7;
+		mse_age_update(serial_mse);
+		send_data(mse_backlog(serial_mse));
+		send_data(mse_backlog_age(serial_mse) >> 7);
+		send_data(interval > 0xFF ? 0xFF : interval);
+		break;
+	}
+	#endif /* USE_MOUSE_SHAPING */
+	#ifdef USE_STATS
+	case 0x03: // CLEAR STATISTICS
+		stats_clear();
+		break;
+	#endif /* USE_STATS */
+	#ifdef PROFILE
+	case 0x10: // PROFILE handle_data()
+	case 0x11: // PROFILE handle_serial_data()
+	case 0x12: // PROFILE ADB SRQ
+	case 0x13: // PROFILE ADB TALK
+	case 0x14: // PROFILE ADB LISTEN
 		{
-			kbd_reg2_high &= ~_BV(KBD_REG2_CMD_BIT);
+			// calls, then shortest, longest and total time, all most
+			// significant byte first; the slot then starts over.  The
+			// times are Timer1 ticks, multiply by PROFILE_TICK_CYCLES
+			// (8) for CPU cycles
+			struct profile p;
+			profile_take(query & 0x0F, &p);
+			send_data(p.count >> 8);
+			send_data(p.count);
+			send_data(p.min >> 8);
+			send_data(p.min);
+			send_data(p.max >> 8);
+			send_data(p.max);
+			send_data(p.total >> 24);
+			send_data(p.total >> 16);
+			send_data(p.total >> 8);
+			send_data(p.total);
 		}
-		else
+		break;
+	#endif /* PROFILE */
+	default:
+		#ifdef USE_STATS
+		if (query >= 0x20 && query < 0x20 + STATS)
 		{
-			kbd_reg2_high |= _BV(KBD_REG2_CMD_BIT);
+			// STATISTICS, counter 0x20 onwards, most significant
+			// byte first; see stats.h for the list
+			uint16_t v = stats_read(query - 0x20);
+			send_data(v >> 8);
+			send_data(v);
 		}
+		#endif /* USE_STATS */
+		// all others reserved
 		break;
-	case 0x3A: // left option
-	case 0x7C: // right option
-		if (up)
+	}
+	return 0;
+}
+#endif /* USE_USART */
+
+#ifdef USE_FRAMED
+/*
+ * Framed protocol v2, entered with the 0x0B command.  Each frame is a
+ * header byte with the opcode in the upper 4 bits and the payload
+ * length in the lower 4, then the payload, then a checksum byte chosen
+ * so all the bytes of the frame add up to 0xFF.  Opcodes are:
+ * 
+ * 0x0 COMMAND: 1-8 nibble protocol commands, run in order, with any
+ *     replies sent as they would be normally
+ * 0x1 KEYBOARD: 1-8 keycodes, as if sent with 0x4X/0x5X
+ * 0x2 MOUSE: X then Y motion as signed bytes, then optionally the
+ *     button byte, all applied together
+ * 0x3 ARBITRARY REGISTER 0: 2-8 bytes (1-7 with USE_ARB_TRANSPORT)
+ *     that replace the staged register 0 data, which is then queued
+ *     as with 0x02
+ * 0xF NIBBLE MODE: no payload, returns to the nibble protocol
+ * 
+ * With the keyboard built in, some bytes where a header is expected
+ * are keys on their own instead.  A byte from 0x40 to 0xEF is 0x40
+ * plus the keycode for a key going down, or 0x98 plus the keycode for
+ * one coming up, for keycodes 0x00 to 0x57.  For the rest, the
+ * function keys and a few on the keypad, 0xF1 is followed by the
+ * keycode byte, with bit 7 set for up as in a KEYBOARD frame.  These
+ * have no checksum, but are only taken between frames.
+ * 
+ * A header with an unknown opcode or bad length, or a frame that does
+ * not add up, loses its first byte and the rest are parsed again, so
+ * framing recovers by itself after a dropped or corrupted byte.  Single
+ * keys found while doing that are dropped rather than taken, so a lost
+ * byte may lose a key but won't make one up out of frame data.  A frame
+ * left incomplete for FRAME_IDLE_TICKS is dropped when the next byte
+ * comes in, so a truncated frame at the end of a burst can't swallow
+ * whatever is sent next.
+ */
+static uint8_t handle_frame(uint8_t v)
+{
+	uint16_t now = HAL_TIMER1_READ();
+	if (frame_len && (uint16_t) (now - frame_time) >= FRAME_IDLE_TICKS)
+	{
+		frame_len = 0;
+	}
+	frame_time = now;
+	
+	#ifdef USE_KEYBOARD
+	if (frame_len == 1 && frame[0] == FRAME_KEY_ESCAPE)
+	{
+		frame_len = 0;
+		handle_keyboard_data(v);
+		return 0;
+	}
+	if (frame_len == 0 && v == FRAME_KEY_ESCAPE)
+	{
+		// wait for the keycode
+		frame[frame_len++] = v;
+		return 0;
+	}
+	if (frame_len == 0 && v >= FRAME_KEY_DOWN && v < FRAME_KEY_END)
+	{
+		if (v < FRAME_KEY_UP)
 		{
-			kbd_reg2_high &= ~_BV(KBD_REG2_OPT_BIT);
+			handle_keyboard_data(v - FRAME_KEY_DOWN);
 		}
 		else
 		{
-			kbd_reg2_high |= _BV(KBD_REG2_OPT_BIT);
+			handle_keyboard_data((v - FRAME_KEY_UP) | 0x80);
 		}
-		break;
-	case 0x38: // left shift
-	case 0x7B: // right shift
-		if (up)
+		return 0;
+	}
+	#endif /* USE_KEYBOARD */
+	frame[frame_len++] = v;
+	while (frame_len)
+	{
+		uint8_t len = frame[0] & 0x0F;
+		if (frame_length_ok(frame[0] >> 4, len))
 		{
-			kbd_reg2_high &= ~_BV(KBD_REG2_SHFT_BIT);
+			// wait for the rest of the frame
+			if (frame_len < len + 2) return 0;
+			
+			uint8_t sum = 0;
+			uint8_t i;
+			for (i = 0; i < len + 2; i++)
+			{
+				sum += frame[i];
+			}
+			if (sum == 0xFF)
+			{
+				frame_len = 0;
+				frame_execute(frame[0] >> 4, &frame[1], len);
+				return 0;
+			}
 		}
-		else
+		
+		// not a frame, so try again from the next byte
+		uint8_t i;
+		for (i = 1; i < frame_len; i++)
 		{
-			kbd_reg2_high |= _BV(KBD_REG2_SHFT_BIT);
+			frame[i - 1] = frame[i];
 		}
-		break;
-	case 0x36: // left control
-	case 0x7D: // right control
-		if (up)
+		frame_len--;
+	}
+	return 0;
+}
+
+/*
+ * Whether the given payload length makes sense for the opcode.
+ * Opcodes for devices that aren't built in are never valid.
+ */
+static uint8_t frame_length_ok(uint8_t op, uint8_t len)
+{
+	switch (op)
+	{
+	case 0x0:
+		return len >= 1 && len <= FRAME_PAYLOAD_MAX;
+	#ifdef USE_KEYBOARD
+	case 0x1:
+		return len >= 1 && len <= FRAME_PAYLOAD_MAX;
+	#endif /* USE_KEYBOARD */
+	#ifdef USE_MOUSE
+	case 0x2:
+		return len == 2 || len == 3;
+	#endif /* USE_MOUSE */
+	#ifdef USE_ARBITRARY
+	case 0x3:
+		return len >= ARB_PACKET_MIN && len <= ARB_PACKET_MAX;
+	#endif /* USE_ARBITRARY */
+	case 0xF:
+		return len == 0;
+	default:
+		return 0;
+	}
+}
+
+static void frame_execute(uint8_t op, const uint8_t *payload, uint8_t len)
+{
+	uint8_t i;
+	// a command frame may end partway into a prefix command, whose
+	// arguments must not be taken from a later frame
+	serial_prefix = 0;
+	switch (op)
+	{
+	case 0x0: // COMMAND
+		for (i = 0; i < len; i++)
 		{
-			kbd_reg2_high &= ~_BV(KBD_REG2_CNTL_BIT);
+			uint8_t response = handle_nibble(payload[i]);
+			#ifndef DEBUG_MODE
+				if (response > 0)
+				{
+					send_data(response);
+				}
+			#else
+				(void) response;
+			#endif /* ! DEBUG_MODE */
 		}
-		else
+		break;
+	#ifdef USE_KEYBOARD
+	case 0x1: // KEYBOARD
+		for (i = 0; i < len; i++)
 		{
-			kbd_reg2_high |= _BV(KBD_REG2_CNTL_BIT);
+			handle_keyboard_data(payload[i]);
 		}
 		break;
-	case 0x39: // caps lock
-		if (up)
+	#endif /* USE_KEYBOARD */
+	#ifdef USE_MOUSE
+	case 0x2: // MOUSE
+		handle_mouse_report(payload[0], payload[1],
+				len == 3 ? payload[2] : mse_btn_data[serial_mse]);
+		break;
+	#endif /* USE_MOUSE */
+	#ifdef USE_ARBITRARY
+	case 0x3: // ARBITRARY REGISTER 0
+		for (i = 0; i < len; i++)
 		{
-			kbd_reg2_high &= ~_BV(KBD_REG2_CPSL_BIT);
+			arb_buf0[i] = payload[i];
 		}
-		else
+		arb_buf0_len = len;
+		arb_buf0_tmp = 0;
+		if (! arb_queue_push())
 		{
-			kbd_reg2_high |= _BV(KBD_REG2_CPSL_BIT);
+			// the next frame replaces it, so it's lost
+			STATS_BUMP(STAT_ARB_DROPPED);
 		}
 		break;
-	case 0x33: // delete
+	#endif /* USE_ARBITRARY */
+	case 0xF: // NIBBLE MODE
+		framed = 0;
+		break;
+	}
+}
+#endif /* USE_FRAMED */
+
+#ifdef USE_KEYBOARD
+/*
+ * Keycodes that are also tracked in register 2, giving which byte and
+ * bit reflect whether the key is down.  Everything else is zero.
+ */
+#define KBD_MOD_LOW(b) (0x40 | (b))
+#define KBD_MOD_HIGH(b) (0x80 | (b))
+static const uint8_t kbd_mod_table[128] HAL_FLASH = {
+	[0x33] = KBD_MOD_HIGH(KBD_REG2_DEL_BIT), // delete
+	[0x36] = KBD_MOD_HIGH(KBD_REG2_CNTL_BIT), // left control
+	[0x37] = KBD_MOD_HIGH(KBD_REG2_CMD_BIT), // command
+	[0x38] = KBD_MOD_HIGH(KBD_REG2_SHFT_BIT), // left shift
+	[0x39] = KBD_MOD_HIGH(KBD_REG2_CPSL_BIT), // caps lock
+	[0x3A] = KBD_MOD_HIGH(KBD_REG2_OPT_BIT), // left option
+	[0x47] = KBD_MOD_LOW(KBD_REG2_NUML_BIT), // num lock
+	[0x71] = KBD_MOD_LOW(KBD_REG2_SCRL_BIT), // scroll lock
+	[0x7B] = KBD_MOD_HIGH(KBD_REG2_SHFT_BIT), // right shift
+	[0x7C] = KBD_MOD_HIGH(KBD_REG2_OPT_BIT), // right option
+	[0x7D] = KBD_MOD_HIGH(KBD_REG2_CNTL_BIT), // right control
+	[0x7F] = KBD_MOD_HIGH(KBD_REG2_RST_BIT) // power
+};
+
+/*
+ * Takes a given keycode and applies it to both the keyboard buffer and
+ * the relevant bits of register 2.
+ */
+static void handle_keyboard_data(uint8_t kc)
+{
+	uint8_t up = kc >> 7; // flag for up or down
+	uint8_t key = kc & 0x7F; // and the key to test
+	
+	if (key == 0x7F)
+	{
+		// the power key goes out twice, in the same transaction
+		ring_buffer_add_dual(&kbd_buf[serial_kbd], kc, kc);
+	}
+	else
+	{
+		// keyboard upper nibble, push into buffer with previous
+		// low nibble and reset the lower nibble temporary value
+		ring_buffer_add(&kbd_buf[serial_kbd], kc);
+		kbd_temp = 0;
+	}
+	device_changed(ADB_KBD_FLAG_MASK(serial_kbd));
+	
+	// update register 2 flags information with keys
+	uint8_t mod = HAL_FLASH_BYTE(&kbd_mod_table[key]);
+	if (mod)
+	{
+		uint8_t *reg = (mod & 0x80) ? &kbd_reg2_high[serial_kbd]
+				: &kbd_reg2_low[serial_kbd];
+		uint8_t mask = _BV(mod & 0x07);
 		if (up)
 		{
-			kbd_reg2_high &= ~_BV(KBD_REG2_DEL_BIT);
+			*reg &= ~mask;
 		}
 		else
 		{
-			kbd_reg2_high |= _BV(KBD_REG2_DEL_BIT);
+			*reg |= mask;
 		}
-		break;
 	}
 }
 #endif /* USE_KEYBOARD */
@@ -21,12 +21,14 @@
 
 /*
  * Handles the poll-based reading of the serial register.  This must be
- * called about every 50us to ensure no data in the system is lost.
+ * called about every 50us to ensure no data in the system is lost,
+ * unless USE_USART_RX_IRQ is set: then an interrupt buffers incoming
+ * bytes and this only needs to keep up on average.
  * 
- * As of the last time this was updated (2016-10-21), execution time
- * was ~10us in the worst case, using avr-gcc 4.9.2 in -Os.  This
- * should be safe on most systems.  To re-profile, take a look at the
- * test.c code.
+ * The ~10us worst case measured on 2016-10-21, with avr-gcc 4.9.2 in
+ * -Os, predates the command and keycode tables and hasn't been taken
+ * again since.  To re-profile, run "make bench" for the test.c sweeps,
+ * or build with PROFILE to measure it on real traffic (see profile.h).
  * 
  * Return data should be inserted into the serial return buffer for the
  * next transaction.
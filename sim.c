@@ -0,0 +1,1145 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Virtual-time ADB bus simulator, built natively with "make sim".
+ * 
+ * This plays the part of the Mac: it drives attention, sync, the
+ * command byte, the stop bit, Tlt and any listen data onto the
+ * simulated line from hal_host.c, with optional timing jitter, while
+ * handle_adb() runs against it in virtual time.  Device replies are
+ * decoded from the line, and at the end a report is printed with the
+ * transaction rates, the rate of each protocol error code adb.c
+ * reports (the DEBUG_MODE codes), and the closest any timing came to
+ * the edges of the windows defined by ADB_SIGDEL_*.
+ * 
+ * Usage: sim [-n passes] [-j jitter%] [-g glitch%] [-s seed]
+ *            [-e max_rate] [-c devices] [-q] [script]
+ * 
+ * The script is run -n times (default 1).  If -e is given, the exit
+ * status is non-zero when the error rate exceeds it.  Each script line
+ * is one of the following, with bytes in hex and all else in decimal:
+ * 
+ *   talk ADDR REG [= BYTES...|-]   talk, optionally checking the reply
+ *   poll COUNT ADDRS...            register 0 talks as the Mac polls
+ *   listen ADDR REG BYTES...       listen with the given data
+ *   flush ADDR                     flush the device
+ *   reset                          hold the line for a bus reset
+ *   serial BYTES...                feed bytes to the serial port
+ *   idle US                        leave the bus idle
+ *   jitter PERCENT                 change the timing jitter
+ *   glitch PERCENT                 change the spike rate
+ * 
+ * With -g, the given percentage of commands get a spike: the line is
+ * asserted for a few microseconds at a random point between the start
+ * of the sync and the end of the command byte, as noise on a marginal
+ * bus would.  The recovery codes adb.c reports for these (C0 to C8)
+ * are counted but not treated as errors.
+ * 
+ * If no script is given, a default that exercises each device is used.
+ * With -q, a built in script instead keeps every device busy and polls
+ * them as the Mac does, to measure the SRQ scheduling in registers.h.
+ * A poll talks to the address that last answered, moving on to the
+ * next listed address after an SRQ or no reply.  The report then has
+ * the replies from each address and the most times each device slot
+ * was passed over while waiting (device_starve).
+ * 
+ * With -c, no script is run.  Instead the given number of devices
+ * start at the same address and a model of the Mac's address
+ * resolution separates them, -n times, reporting how many polls (talk
+ * register 3) that took.  As the Mac does, each device that answers is
+ * moved to a free address from 0x8 to 0xF, and once nobody answers the
+ * last one found is moved back.  The simulator only runs one copy of the
+ * firmware, so this models the devices rather than running them: each
+ * gets its own clock error and its own copy of the adb.h talk delay
+ * generator, which it stirs with its own measurements of each attention
+ * and sync as adb.c does, and whichever starts replying first wins while the rest
+ * see the line taken and set their collision flag.  Devices that start
+ * too close together to notice each other both move, which the Mac
+ * can't tell; the model then repeats the resolution at that address,
+ * as a later reset would.  If -e is given, the exit status is non-zero
+ * when the unresolved rate exceeds it.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "adb.h"
+
+// nominal bus timing driven by the master, in microseconds
+#define SIM_IDLE 100
+#define SIM_ATTN 800
+#define SIM_SYNC 70
+#define SIM_BIT_SHORT 35
+#define SIM_BIT_LONG 65
+#define SIM_TLT 200
+#define SIM_RESET 3000
+// quiet time after which a transaction is considered over
+#define SIM_END_GAP 400
+// width of an injected spike, well under the shortest bit
+#define SIM_SPIKE 4
+
+// spec windows for what the device drives, in microseconds
+#define SIM_DEV_TLT_MIN 140
+#define SIM_DEV_TLT_MAX 260
+#define SIM_DEV_CELL_MIN 70
+#define SIM_DEV_CELL_MAX 130
+#define SIM_DEV_SRQ_MIN 210
+#define SIM_DEV_SRQ_MAX 390
+
+// Timer0 tick lengths, to turn ADB_SIGDEL_* into microseconds
+#define SIM_TICK8 (8.0 * 1000000 / F_CPU)
+#define SIM_TICK64 (64.0 * 1000000 / F_CPU)
+
+// collision benchmark: most devices, clock tolerance as a fraction,
+// how far apart in microseconds two replies must start for the later
+// one to notice, and the poll count at which a pass is given up on
+#define SIM_COLLIDE_MAX 8
+#define SIM_COLLIDE_OSC 0.01
+#define SIM_COLLIDE_WINDOW 4.0
+#define SIM_COLLIDE_POLLS 1000
+
+#define SIM_MAX_STEPS 256
+#define SIM_MAX_SEGMENTS 128
+#define SIM_MAX_EDGES 192
+
+enum step_type
+{
+	STEP_TALK,
+	STEP_LISTEN,
+	STEP_FLUSH,
+	STEP_RESET,
+	STEP_SERIAL,
+	STEP_IDLE,
+	STEP_JITTER,
+	STEP_POLL,
+	STEP_GLITCH
+};
+
+struct step
+{
+	uint8_t type;
+	uint8_t addr;
+	uint8_t reg;
+	uint8_t len;
+	uint8_t data[32];
+	int8_t expect_len; // -1 for no check
+	uint8_t expect[8];
+	uint32_t value;
+};
+
+struct segment
+{
+	uint8_t asserted;
+	uint8_t after_release;
+	uint64_t cycles;
+};
+
+struct edge
+{
+	uint64_t time;
+	uint8_t asserted;
+};
+
+struct margin
+{
+	const char *name;
+	double lo;
+	double hi;
+	double min;
+	double max;
+	uint64_t count;
+};
+
+static const char *default_script =
+	"reset\n"
+	"serial 41 50 41 58\n"
+	"talk 2 0 = 01 81\n"
+	"talk 2 0 = -\n"
+	"serial 42 50\n"
+	"talk 3 0 = -\n"
+	"talk 2 0 = 02 FF\n"
+	"serial 85 D2\n"
+	"talk 3 0 = FE 85\n"
+	"talk 3 0 = -\n"
+	"listen 2 2 00 05\n"
+	"talk 2 2 = FF FD\n"
+	"talk 7 0 = -\n"
+	"talk 3 3 = 63 01\n"
+	"flush 2\n";
+
+static const char *srq_script =
+	"reset\n"
+	"serial 21 30 25 3A 02 21 30 25 3A 02\n"
+	"poll 2 2 3 7\n"
+	"serial 4A 50 4B 50\n"
+	"poll 4 2 3 7\n"
+	"serial 21 30 25 3A 02 85 D2\n"
+	"poll 4 2 3 7\n"
+	"serial 4A 50\n"
+	"poll 4 2 3 7\n";
+
+// the script
+static struct step steps[SIM_MAX_STEPS];
+static uint16_t step_count = 0;
+static uint16_t step_pos = 0;
+static uint32_t passes = 1;
+static uint32_t pass = 0;
+static double jitter = 0;
+static double glitch = 0;
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+
+// the transaction on the bus right now
+static struct segment segs[SIM_MAX_SEGMENTS];
+static uint8_t seg_len = 0;
+static uint8_t seg_pos = 0;
+static uint8_t seg_blocked = 0;
+static uint64_t seg_start = 0;
+static uint8_t stop_seg = 0;
+static uint64_t stop_begin = 0;
+static uint64_t stop_end = 0;
+static const struct step *current = 0;
+static struct edge edges[SIM_MAX_EDGES];
+static uint8_t edge_count = 0;
+static uint8_t txn_error = 0;
+
+// results
+static uint64_t transactions = 0;
+static uint64_t talks = 0;
+static uint64_t listens = 0;
+static uint64_t replies = 0;
+static uint64_t srqs = 0;
+static uint64_t bad_replies = 0;
+static uint64_t wrong_replies = 0;
+static uint64_t stray_activity = 0;
+static uint64_t failed = 0;
+static uint64_t spikes = 0;
+static uint64_t codes[256];
+static uint32_t poll_left = 0;
+static uint8_t poll_index = 0;
+static uint64_t poll_replies[16];
+static uint8_t starve_max[ADB_DEVICES];
+
+static struct margin m_attn = { "attention_us", 0, 0, 0, 0, 0 };
+static struct margin m_sync = { "sync_us", 0, 0, 0, 0, 0 };
+static struct margin m_bit1 = { "bit1_low_us", 0, 0, 0, 0, 0 };
+static struct margin m_bit0 = { "bit0_low_us", 0, 0, 0, 0, 0 };
+static struct margin m_high = { "bit_high_us", 0, 0, 0, 0, 0 };
+static struct margin m_stop = { "stop_low_us", 0, 0, 0, 0, 0 };
+static struct margin m_ltlt = { "listen_tlt_us", 0, 0, 0, 0, 0 };
+static struct margin m_lstart = { "listen_start_low_us", 0, 0, 0, 0, 0 };
+static struct margin m_lsync = { "listen_start_high_us", 0, 0, 0, 0, 0 };
+static struct margin m_dtlt = { "device_tlt_us", 0, 0, 0, 0, 0 };
+static struct margin m_dbit1 = { "device_bit1_low_us", 0, 0, 0, 0, 0 };
+static struct margin m_dbit0 = { "device_bit0_low_us", 0, 0, 0, 0, 0 };
+static struct margin m_dcell = { "device_cell_us", 0, 0, 0, 0, 0 };
+static struct margin m_dsrq = { "device_srq_us", 0, 0, 0, 0, 0 };
+static struct margin *margins[] = {
+	&m_attn, &m_sync, &m_bit1, &m_bit0, &m_high, &m_stop, &m_ltlt,
+	&m_lstart, &m_lsync, &m_dtlt, &m_dbit1, &m_dbit0, &m_dcell, &m_dsrq
+};
+
+static void setup_margins();
+static void load_script(const char *);
+static void run_step();
+static void finish_transaction();
+static uint8_t master(uint64_t);
+static void device_edge(uint64_t, uint8_t);
+static void trace(uint8_t);
+static void report(double);
+static const char *code_name(uint8_t);
+static int collide(uint8_t, double);
+
+
+// --- main ---
+
+int main(int argc, char **argv)
+{
+	double max_rate = -1;
+	const char *script = default_script;
+	char *file_buf = 0;
+	uint8_t colliders = 0;
+	int i;
+	
+	for (i = 1; i < argc; i++)
+	{
+		if (! strcmp(argv[i], "-n") && i + 1 < argc)
+		{
+			passes = strtoul(argv[++i], 0, 10);
+		}
+		else if (! strcmp(argv[i], "-j") && i + 1 < argc)
+		{
+			jitter = atof(argv[++i]) / 100;
+		}
+		else if (! strcmp(argv[i], "-g") && i + 1 < argc)
+		{
+			glitch = atof(argv[++i]) / 100;
+		}
+		else if (! strcmp(argv[i], "-s") && i + 1 < argc)
+		{
+			rng_state ^= strtoull(argv[++i], 0, 0) * 0x9E3779B97F4A7C15ULL;
+		}
+		else if (! strcmp(argv[i], "-e") && i + 1 < argc)
+		{
+			max_rate = atof(argv[++i]);
+		}
+		else if (! strcmp(argv[i], "-q"))
+		{
+			script = srq_script;
+		}
+		else if (! strcmp(argv[i], "-c") && i + 1 < argc)
+		{
+			colliders = strtoul(argv[++i], 0, 10);
+			if (colliders < 2 || colliders > SIM_COLLIDE_MAX)
+			{
+				fprintf(stderr, "%s: -c takes 2 to %d devices\n",
+						argv[0], SIM_COLLIDE_MAX);
+				return 2;
+			}
+		}
+		else if (argv[i][0] != '-')
+		{
+			FILE *f = fopen(argv[i], "r");
+			if (! f)
+			{
+				perror(argv[i]);
+				return 2;
+			}
+			file_buf = calloc(1, 65536);
+			if (! fread(file_buf, 1, 65535, f))
+			{
+				fprintf(stderr, "%s: empty script\n", argv[i]);
+				return 2;
+			}
+			fclose(f);
+			script = file_buf;
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-n passes] [-j jitter%%] "
+					"[-g glitch%%] [-s seed] [-e max_rate] "
+					"[-c devices] [-q] [script]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+	if (colliders) return collide(colliders, max_rate);
+	load_script(script);
+	free(file_buf);
+	if (! step_count || ! passes) return 0;
+	setup_margins();
+	
+	// wire the simulation into the HAL and bring up the firmware the
+	// same way main.c does
+	hal_host_master = master;
+	hal_host_device_hook = device_edge;
+	hal_host_trace_hook = trace;
+	adb_init();
+	adb_reset();
+	init_data();
+	memset(codes, 0, sizeof(codes));
+	
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	seg_start = hal_host_cycles;
+	run_step();
+	hal_host_run(handle_adb, ~0ULL >> 1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	
+	report((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	
+	if (max_rate >= 0 && transactions
+			&& (double) failed / transactions > max_rate)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+
+// --- script handling ---
+
+static uint8_t parse_bytes(char **save, uint8_t *buf, uint8_t max)
+{
+	uint8_t n = 0;
+	char *tok;
+	while (n < max && (tok = strtok_r(0, " \t", save)))
+	{
+		buf[n++] = strtoul(tok, 0, 16);
+	}
+	return n;
+}
+
+static void load_script(const char *text)
+{
+	char line[256];
+	unsigned int lineno = 0;
+	
+	while (*text)
+	{
+		size_t len = strcspn(text, "\n");
+		if (len >= sizeof(line)) len = sizeof(line) - 1;
+		memcpy(line, text, len);
+		line[len] = 0;
+		text += strcspn(text, "\n");
+		if (*text) text++;
+		lineno++;
+		
+		char *hash = strchr(line, '#');
+		if (hash) *hash = 0;
+		char *save;
+		char *cmd = strtok_r(line, " \t\r", &save);
+		if (! cmd) continue;
+		if (step_count >= SIM_MAX_STEPS)
+		{
+			fprintf(stderr, "script too long at line %u\n", lineno);
+			exit(2);
+		}
+		
+		struct step *s = &steps[step_count];
+		memset(s, 0, sizeof(*s));
+		s->expect_len = -1;
+		char *a = strtok_r(0, " \t", &save);
+		char *b = a ? strtok_r(0, " \t", &save) : 0;
+		
+		if (! strcmp(cmd, "talk") && b)
+		{
+			s->type = STEP_TALK;
+			s->addr = atoi(a) & 15;
+			s->reg = atoi(b) & 3;
+			char *eq = strtok_r(0, " \t", &save);
+			if (eq && ! strcmp(eq, "="))
+			{
+				char *peek = save;
+				if (peek && strchr(peek, '-'))
+				{
+					s->expect_len = 0;
+				}
+				else
+				{
+					s->expect_len = parse_bytes(&save, s->expect, 8);
+				}
+			}
+		}
+		else if (! strcmp(cmd, "listen") && b)
+		{
+			s->type = STEP_LISTEN;
+			s->addr = atoi(a) & 15;
+			s->reg = atoi(b) & 3;
+			s->len = parse_bytes(&save, s->data, 8);
+			if (s->len < 2)
+			{
+				fprintf(stderr, "listen needs 2+ bytes, line %u\n", lineno);
+				exit(2);
+			}
+		}
+		else if (! strcmp(cmd, "flush") && a)
+		{
+			s->type = STEP_FLUSH;
+			s->addr = atoi(a) & 15;
+		}
+		else if (! strcmp(cmd, "reset"))
+		{
+			s->type = STEP_RESET;
+		}
+		else if (! strcmp(cmd, "serial") && a)
+		{
+			s->type = STEP_SERIAL;
+			s->data[0] = strtoul(a, 0, 16);
+			s->len = 1;
+			if (b)
+			{
+				s->data[1] = strtoul(b, 0, 16);
+				s->len = 2 + parse_bytes(&save, s->data + 2, 30);
+			}
+		}
+		else if (! strcmp(cmd, "idle") && a)
+		{
+			s->type = STEP_IDLE;
+			s->value = atoi(a);
+		}
+		else if (! strcmp(cmd, "poll") && b && atoi(a) > 0)
+		{
+			s->type = STEP_POLL;
+			s->value = atoi(a);
+			s->data[0] = atoi(b) & 15;
+			s->len = 1;
+			while ((b = strtok_r(0, " \t", &save)) && s->len < 16)
+			{
+				s->data[s->len++] = atoi(b) & 15;
+			}
+		}
+		else if (! strcmp(cmd, "jitter") && a)
+		{
+			s->type = STEP_JITTER;
+			s->value = atoi(a);
+		}
+		else if (! strcmp(cmd, "glitch") && a)
+		{
+			s->type = STEP_GLITCH;
+			s->value = atoi(a);
+		}
+		else
+		{
+			fprintf(stderr, "bad script line %u\n", lineno);
+			exit(2);
+		}
+		step_count++;
+	}
+}
+
+
+// --- bus master ---
+
+static double rng_uniform()
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static void margin_add(struct margin *m, double us)
+{
+	if (! m->count || us < m->min) m->min = us;
+	if (! m->count || us > m->max) m->max = us;
+	m->count++;
+}
+
+/*
+ * Adds a segment to the transaction, applying jitter to the nominal
+ * time and recording the result against the margin, if any.
+ */
+static void seg_add(uint8_t asserted, double us, struct margin *m)
+{
+	us *= 1 + jitter * (2 * rng_uniform() - 1);
+	if (m) margin_add(m, us);
+	segs[seg_len].asserted = asserted;
+	segs[seg_len].after_release = 0;
+	segs[seg_len].cycles = us * (F_CPU / 1000000);
+	seg_len++;
+}
+
+static void gen_bit(uint8_t bit)
+{
+	seg_add(1, bit ? SIM_BIT_SHORT : SIM_BIT_LONG, bit ? &m_bit1 : &m_bit0);
+	seg_add(0, bit ? SIM_BIT_LONG : SIM_BIT_SHORT, &m_high);
+}
+
+static void gen_byte(uint8_t v)
+{
+	uint8_t i;
+	for (i = 0; i < 8; i++)
+	{
+		gen_bit(v & 0x80);
+		v <<= 1;
+	}
+}
+
+/*
+ * Splits a random released segment from the given one up to the end,
+ * putting a spike at a random point inside it.
+ */
+static void gen_spike(uint8_t from)
+{
+	uint64_t spike = SIM_SPIKE * (F_CPU / 1000000);
+	uint8_t i;
+	
+	do
+	{
+		i = from + rng_uniform() * (seg_len - from);
+	}
+	while (segs[i].asserted);
+	if (seg_len + 2 > SIM_MAX_SEGMENTS || segs[i].cycles < 3 * spike)
+	{
+		return;
+	}
+	
+	uint64_t before = spike + rng_uniform() * (segs[i].cycles - 3 * spike);
+	memmove(&segs[i + 3], &segs[i + 1],
+			(seg_len - i - 1) * sizeof(struct segment));
+	segs[i + 2] = segs[i];
+	segs[i + 2].cycles -= before + spike;
+	segs[i + 1].asserted = 1;
+	segs[i + 1].cycles = spike;
+	segs[i].cycles = before;
+	seg_len += 2;
+	spikes++;
+}
+
+static void gen_command(uint8_t command)
+{
+	seg_add(0, SIM_IDLE, 0);
+	seg_add(1, SIM_ATTN, &m_attn);
+	uint8_t sync = seg_len;
+	seg_add(0, SIM_SYNC, &m_sync);
+	gen_byte(command);
+	if (glitch > 0 && rng_uniform() < glitch) gen_spike(sync);
+	stop_seg = seg_len;
+	seg_add(1, SIM_BIT_LONG, &m_stop);
+}
+
+/*
+ * Works through the script until the next step that needs the bus,
+ * and queues up its segments.  Halts the run at the end.
+ */
+static void run_step()
+{
+	uint8_t i;
+	
+	seg_len = 0;
+	seg_pos = 0;
+	seg_blocked = 0;
+	stop_seg = 0xFF;
+	edge_count = 0;
+	txn_error = 0;
+	current = 0;
+	
+	while (! seg_len)
+	{
+		if (step_pos >= step_count)
+		{
+			step_pos = 0;
+			if (++pass >= passes) hal_host_halt();
+		}
+		const struct step *s = &steps[step_pos++];
+		
+		switch (s->type)
+		{
+		case STEP_TALK:
+			gen_command((s->addr << 4) | 0x0C | s->reg);
+			break;
+		case STEP_LISTEN:
+			gen_command((s->addr << 4) | 0x08 | s->reg);
+			seg_add(0, SIM_TLT, &m_ltlt);
+			segs[seg_len - 1].after_release = 1;
+			seg_add(1, SIM_BIT_SHORT, &m_lstart);
+			seg_add(0, SIM_BIT_LONG, &m_lsync);
+			for (i = 0; i < s->len; i++)
+			{
+				gen_byte(s->data[i]);
+			}
+			seg_add(1, SIM_BIT_LONG, 0);
+			break;
+		case STEP_FLUSH:
+			gen_command((s->addr << 4) | 0x01);
+			break;
+		case STEP_RESET:
+			seg_add(0, SIM_IDLE, 0);
+			seg_add(1, SIM_RESET, 0);
+			break;
+		case STEP_SERIAL:
+			for (i = 0; i < s->len; i++)
+			{
+				hal_host_usart_push(s->data[i]);
+			}
+			break;
+		case STEP_IDLE:
+			seg_add(0, s->value, 0);
+			break;
+		case STEP_JITTER:
+			jitter = s->value / 100.0;
+			break;
+		case STEP_GLITCH:
+			glitch = s->value / 100.0;
+			break;
+		case STEP_POLL:
+			if (! poll_left) poll_left = s->value;
+			gen_command((s->data[poll_index % s->len] << 4) | 0x0C);
+			// stay on this step until the polls are done
+			if (--poll_left) step_pos--;
+			break;
+		}
+		current = s;
+	}
+}
+
+/*
+ * The line as driven by the master at the given time.  This also
+ * steps the script forward once the bus has gone quiet.
+ */
+static uint8_t master(uint64_t now)
+{
+	while (1)
+	{
+		if (seg_blocked) return 0;
+		if (seg_pos < seg_len)
+		{
+			if (now < seg_start + segs[seg_pos].cycles)
+			{
+				return segs[seg_pos].asserted;
+			}
+			if (seg_pos == stop_seg) stop_begin = seg_start;
+			seg_start += segs[seg_pos].cycles;
+			if (seg_pos == stop_seg) stop_end = seg_start;
+			seg_pos++;
+			if (seg_pos < seg_len && segs[seg_pos].after_release
+					&& hal_host_device_asserting())
+			{
+				// wait for the device (SRQ) before starting the next
+				seg_blocked = 1;
+				return 0;
+			}
+			continue;
+		}
+		
+		// wait for the device to finish anything it is sending
+		if (hal_host_device_asserting()) return 0;
+		uint64_t quiet = seg_start;
+		if (edge_count && edges[edge_count - 1].time > quiet)
+		{
+			quiet = edges[edge_count - 1].time;
+		}
+		if (now < quiet + HAL_HOST_US(SIM_END_GAP)) return 0;
+		
+		finish_transaction();
+		seg_start = now;
+		run_step();
+	}
+}
+
+static void device_edge(uint64_t time, uint8_t asserted)
+{
+	if (edge_count < SIM_MAX_EDGES)
+	{
+		edges[edge_count].time = time;
+		edges[edge_count].asserted = asserted;
+		edge_count++;
+	}
+	if (! asserted && seg_blocked)
+	{
+		seg_blocked = 0;
+		seg_start = time;
+	}
+}
+
+static void trace(uint8_t code)
+{
+	codes[code]++;
+	if ((code >= 0xE0 && code != 0xFF) || (code >= 0xDA && code <= 0xDD))
+	{
+		txn_error = 1;
+	}
+}
+
+static double cycles_to_us(uint64_t c)
+{
+	return (double) c / (F_CPU / 1000000);
+}
+
+/*
+ * Decodes what the device did during the transaction that just ended
+ * and adds it to the results.
+ */
+static void finish_transaction()
+{
+	uint8_t i = 0;
+	uint8_t bad = 0;
+	uint8_t srq = 0;
+	uint8_t len = 0;
+	
+	if (! current) return;
+	transactions++;
+	for (i = 0; i < ADB_DEVICES; i++)
+	{
+		if (device_starve[i] > starve_max[i])
+		{
+			starve_max[i] = device_starve[i];
+		}
+	}
+	i = 0;
+	
+	// a device assertion that starts during the stop bit is an SRQ
+	uint64_t line_free = stop_end;
+	if (stop_seg != 0xFF && edge_count >= 2 && edges[0].asserted
+			&& edges[0].time < stop_end)
+	{
+		srq = 1;
+		srqs++;
+		margin_add(&m_dsrq, cycles_to_us(edges[1].time - stop_begin));
+		if (edges[1].time > line_free) line_free = edges[1].time;
+		i = 2;
+	}
+	
+	uint8_t pulses = (edge_count - i) / 2;
+	if (current->type == STEP_TALK || current->type == STEP_POLL)
+	{
+		uint8_t reply[8];
+		talks++;
+		if (pulses)
+		{
+			replies++;
+			margin_add(&m_dtlt, cycles_to_us(edges[i].time - line_free));
+			if (pulses < 10 || (pulses - 2) % 8 || pulses > 66) bad = 1;
+			uint8_t p;
+			for (p = 0; p < pulses; p++)
+			{
+				const struct edge *e = &edges[i + p * 2];
+				double low = cycles_to_us(e[1].time - e[0].time);
+				uint8_t bit = low < ADB_SIGDEL_BIT_SPLIT * SIM_TICK8;
+				margin_add(bit ? &m_dbit1 : &m_dbit0, low);
+				if (p + 1 < pulses)
+				{
+					margin_add(&m_dcell, cycles_to_us(e[2].time - e[0].time));
+				}
+				if (p == 0 && ! bit) bad = 1;
+				if (p == pulses - 1 && bit) bad = 1;
+				if (p > 0 && p < pulses - 1 && ! bad)
+				{
+					reply[(p - 1) / 8] = (reply[(p - 1) / 8] << 1) | bit;
+				}
+			}
+			if (! bad) len = (pulses - 2) / 8;
+		}
+		if (bad) bad_replies++;
+		if (current->expect_len >= 0 && ! bad
+				&& (len != current->expect_len
+					|| memcmp(reply, current->expect, len)))
+		{
+			wrong_replies++;
+			bad = 1;
+		}
+	}
+	else
+	{
+		if (current->type == STEP_LISTEN) listens++;
+		if (pulses) stray_activity++;
+	}
+	
+	if (current->type == STEP_POLL)
+	{
+		uint8_t addr = current->data[poll_index % current->len];
+		if (len) poll_replies[addr]++;
+		if (srq || ! len) poll_index = (poll_index + 1) % current->len;
+	}
+	
+	if (bad || txn_error) failed++;
+}
+
+
+// --- results ---
+
+static void setup_margins()
+{
+	m_attn.lo = ADB_SIGDEL_ATTN_MIN * SIM_TICK64;
+	m_attn.hi = ADB_SIGDEL_ATTN_MAX * SIM_TICK64;
+	m_sync.lo = ADB_SIGDEL_SYNC_MIN * SIM_TICK8;
+	m_sync.hi = ADB_SIGDEL_SYNC_MAX * SIM_TICK8;
+	m_bit1.lo = ADB_SIGDEL_BIT_SHORT * SIM_TICK8;
+	m_bit1.hi = ADB_SIGDEL_BIT_SPLIT * SIM_TICK8;
+	m_bit0.lo = ADB_SIGDEL_BIT_SPLIT * SIM_TICK8;
+	m_bit0.hi = ADB_SIGDEL_BIT_LONG * SIM_TICK8;
+	m_high.hi = ADB_SIGDEL_BIT_LONG * SIM_TICK8;
+	m_stop.hi = ADB_SIGDEL_SRQ_MAX * SIM_TICK64;
+	m_ltlt.hi = ADB_SIGDEL_LISTEN1 * SIM_TICK64;
+	m_lstart.hi = ADB_SIGDEL_LISTEN2 * SIM_TICK64;
+	m_lsync.hi = ADB_SIGDEL_LISTEN_SYNC * SIM_TICK8;
+	m_dtlt.lo = SIM_DEV_TLT_MIN;
+	m_dtlt.hi = SIM_DEV_TLT_MAX;
+	m_dbit1.lo = m_bit1.lo;
+	m_dbit1.hi = m_bit1.hi;
+	m_dbit0.lo = m_bit0.lo;
+	m_dbit0.hi = m_bit0.hi;
+	m_dcell.lo = SIM_DEV_CELL_MIN;
+	m_dcell.hi = SIM_DEV_CELL_MAX;
+	m_dsrq.lo = SIM_DEV_SRQ_MIN;
+	m_dsrq.hi = SIM_DEV_SRQ_MAX;
+}
+
+static const char *code_name(uint8_t code)
+{
+	switch (code)
+	{
+	case 0xE0: return "sync_window";
+	case 0xE4: return "command_read";
+	case 0xE8: return "stop_bit_srq";
+	case 0xEC: return "talk_preempted";
+	case 0xED: return "talk_start_collision";
+	case 0xEE: return "talk_start_error";
+	case 0xEF: return "talk_data_error";
+	case 0xDA: return "listen_no_start";
+	case 0xDB: return "listen_start_long";
+	case 0xDC: return "listen_no_data";
+	case 0xDD: return "listen_short";
+	case 0xDE: return "listen_register3";
+	case 0xDF: return "listen_register";
+	case 0xC0: return "sync_recovered";
+	case 0xC4: return "spike_skipped";
+	case 0xC8: return "srq_skipped";
+	case 0xFF: return "reset";
+	default:
+		if (code >= 0xD0 && code <= 0xD7) return "talk_register3";
+		return "unknown";
+	}
+}
+
+static void report(double host_seconds)
+{
+	double virt = cycles_to_us(hal_host_cycles) / 1000000;
+	uint16_t c;
+	uint8_t i;
+	
+	printf("passes %u\n", passes);
+	printf("transactions %llu\n", (unsigned long long) transactions);
+	printf("virtual_seconds %.6f\n", virt);
+	printf("host_seconds %.6f\n", host_seconds);
+	printf("transactions_per_virtual_second %.1f\n",
+			virt > 0 ? transactions / virt : 0);
+	printf("transactions_per_host_second %.1f\n",
+			host_seconds > 0 ? transactions / host_seconds : 0);
+	printf("talks %llu\n", (unsigned long long) talks);
+	printf("listens %llu\n", (unsigned long long) listens);
+	printf("replies %llu\n", (unsigned long long) replies);
+	printf("srqs %llu\n", (unsigned long long) srqs);
+	printf("bad_replies %llu\n", (unsigned long long) bad_replies);
+	printf("wrong_replies %llu\n", (unsigned long long) wrong_replies);
+	printf("stray_activity %llu\n", (unsigned long long) stray_activity);
+	printf("serial_overruns %lu\n", (unsigned long) hal_host_usart_overruns);
+	printf("serial_overwrites %lu\n", (unsigned long) hal_host_usart_overwrites);
+	printf("spikes %llu\n", (unsigned long long) spikes);
+	printf("failed %llu\n", (unsigned long long) failed);
+	printf("error_rate %.9f\n",
+			transactions ? (double) failed / transactions : 0);
+	
+	// code name count rate
+	for (c = 0xC0; c <= 0xFF; c++)
+	{
+		if (! codes[c]) continue;
+		printf("code %02X %s %llu %.9f\n", c, code_name(c),
+				(unsigned long long) codes[c],
+				transactions ? (double) codes[c] / transactions : 0);
+	}
+	
+	// poll_replies address count
+	for (i = 0; i < 16; i++)
+	{
+		if (! poll_replies[i]) continue;
+		printf("poll_replies %u %llu\n", i,
+				(unsigned long long) poll_replies[i]);
+	}
+	// starve_max slot count
+	for (i = 0; i < ADB_DEVICES; i++)
+	{
+		printf("starve_max %u %u\n", i, starve_max[i]);
+	}
+	
+	// margin name count window_lo window_hi min max worst
+	for (i = 0; i < sizeof(margins) / sizeof(margins[0]); i++)
+	{
+		const struct margin *m = margins[i];
+		if (! m->count) continue;
+		double worst = m->min - m->lo;
+		if (m->hi - m->max < worst) worst = m->hi - m->max;
+		printf("margin %s %llu %.1f %.1f %.1f %.1f %.1f\n", m->name,
+				(unsigned long long) m->count, m->lo, m->hi,
+				m->min, m->max, worst);
+	}
+}
+
+
+// --- collision benchmark ---
+
+struct collider
+{
+	uint16_t random;
+	uint8_t addr;
+	uint8_t collision;
+	double clock;
+};
+
+static struct collider colliders[SIM_COLLIDE_MAX];
+static uint8_t collider_count;
+
+/*
+ * Every device on the bus measures each attention and sync with its
+ * own clock and stirs the results into its generator, as adb.c does.
+ */
+static void collide_sync()
+{
+	double attn = SIM_ATTN * (1 + jitter * (2 * rng_uniform() - 1));
+	double sync = SIM_SYNC * (1 + jitter * (2 * rng_uniform() - 1));
+	uint8_t i;
+	
+	for (i = 0; i < collider_count; i++)
+	{
+		struct collider *c = &colliders[i];
+		uint8_t ticks = attn / SIM_TICK64 * c->clock + rng_uniform();
+		c->random = adb_stir(c->random, ticks << 8);
+		ticks = sync / SIM_TICK8 * c->clock + rng_uniform();
+		c->random = adb_stir(c->random, ticks);
+	}
+}
+
+/*
+ * Talk register 3 to the given address, then a listen register 3
+ * moving whoever answered to the new address with handler 0xFE.
+ * Returns the number of devices that moved.
+ */
+static uint8_t collide_poll(uint8_t addr, uint8_t naddr)
+{
+	double start[SIM_COLLIDE_MAX];
+	double first = -1;
+	uint8_t moved = 0;
+	uint8_t i;
+	
+	collide_sync();
+	for (i = 0; i < collider_count; i++)
+	{
+		struct collider *c = &colliders[i];
+		if (c->addr != addr) continue;
+		c->random = adb_lfsr(c->random);
+		start[i] = (ADB_TALK_DELAY(c->random) + rng_uniform())
+				* SIM_TICK64 / c->clock;
+		if (first < 0 || start[i] < first) first = start[i];
+	}
+	if (first < 0) return 0;
+	for (i = 0; i < collider_count; i++)
+	{
+		struct collider *c = &colliders[i];
+		if (c->addr != addr) continue;
+		if (start[i] > first + SIM_COLLIDE_WINDOW) c->collision = 1;
+	}
+	
+	collide_sync();
+	for (i = 0; i < collider_count; i++)
+	{
+		struct collider *c = &colliders[i];
+		if (c->addr != addr) continue;
+		if (c->collision)
+		{
+			c->collision = 0;
+		}
+		else
+		{
+			c->addr = naddr;
+			moved++;
+		}
+	}
+	return moved;
+}
+
+/*
+ * Gives the lowest address from 0x8 to 0xF that no device is using,
+ * where the Mac moves a device it has found, or 0xF if there is none.
+ */
+static uint8_t collide_free()
+{
+	uint8_t addr;
+	uint8_t i;
+	
+	for (addr = 0x8; addr < 0xF; addr++)
+	{
+		for (i = 0; i < collider_count; i++)
+		{
+			if (colliders[i].addr == addr) break;
+		}
+		if (i == collider_count) break;
+	}
+	return addr;
+}
+
+/*
+ * Gives an address still shared by more than one device, or 0 if they
+ * have all been separated.
+ */
+static uint8_t collide_shared()
+{
+	uint8_t i, j;
+	
+	for (i = 0; i < collider_count; i++)
+	{
+		for (j = i + 1; j < collider_count; j++)
+		{
+			if (colliders[i].addr == colliders[j].addr)
+			{
+				return colliders[i].addr;
+			}
+		}
+	}
+	return 0;
+}
+
+static int collide(uint8_t count, double max_rate)
+{
+	uint64_t total = 0;
+	uint64_t ties = 0;
+	uint64_t unresolved = 0;
+	uint32_t most = 0;
+	uint8_t i;
+	
+	collider_count = count;
+	for (pass = 0; pass < passes; pass++)
+	{
+		// all power up in the same state at the same address, the
+		// only difference being their clocks
+		for (i = 0; i < count; i++)
+		{
+			colliders[i].random = 1;
+			colliders[i].addr = 1;
+			colliders[i].collision = 0;
+			colliders[i].clock = 1 + SIM_COLLIDE_OSC
+					* (2 * rng_uniform() - 1);
+		}
+		
+		// the Mac talks to an address until nobody answers, moving
+		// each answer to a free address in the upper half, then moves
+		// the last one found back (with a listen, not a poll)
+		uint32_t polls = 0;
+		uint8_t addr;
+		while ((addr = collide_shared()) && polls < SIM_COLLIDE_POLLS)
+		{
+			uint8_t moved;
+			uint8_t last = 0;
+			do
+			{
+				uint8_t naddr = collide_free();
+				moved = collide_poll(addr, naddr);
+				if (moved) last = naddr;
+				if (moved > 1) ties++;
+				polls++;
+			} while (moved && polls < SIM_COLLIDE_POLLS);
+			for (i = 0; i < count && last; i++)
+			{
+				if (colliders[i].addr == last) colliders[i].addr = addr;
+			}
+		}
+		if (addr) unresolved++;
+		total += polls;
+		if (polls > most) most = polls;
+	}
+	
+	printf("passes %u\n", passes);
+	printf("collide_devices %u\n", count);
+	printf("collide_polls_mean %.2f\n",
+			passes ? (double) total / passes : 0);
+	printf("collide_polls_max %u\n", most);
+	printf("collide_ties %llu\n", (unsigned long long) ties);
+	printf("collide_unresolved %llu\n", (unsigned long long) unresolved);
+	
+	if (max_rate >= 0 && passes
+			&& (double) unresolved / passes > max_rate)
+	{
+		return 1;
+	}
+	return 0;
+}
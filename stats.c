@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#ifdef USE_STATS
+
+uint16_t stats[STATS];
+
+void stats_clear()
+{
+	uint8_t i;
+	uint8_t sreg = HAL_IRQ_SAVE();
+	for (i = 0; i < STATS; i++)
+	{
+		stats[i] = 0;
+	}
+	HAL_IRQ_RESTORE(sreg);
+}
+
+/*
+ * Reads one counter with interrupts held off, as a 16-bit load takes
+ * two instructions and a bump can land between them.
+ */
+uint16_t stats_read(uint8_t id)
+{
+	uint8_t sreg = HAL_IRQ_SAVE();
+	uint16_t v = stats[id];
+	HAL_IRQ_RESTORE(sreg);
+	return v;
+}
+
+/*
+ * Counts an ADB debug code against its error counter.  Codes that only
+ * trace normal operation are ignored.
+ */
+void stats_code(uint8_t c)
+{
+	switch (c)
+	{
+	case 0xE0:
+		stats_bump(STAT_SYNC);
+		break;
+	case 0xE4:
+		stats_bump(STAT_COMMAND);
+		break;
+	case 0xE8:
+		stats_bump(STAT_SRQ_ERROR);
+		break;
+	case 0xEC:
+		stats_bump(STAT_TALK_BEATEN);
+		break;
+	case 0xED:
+		stats_bump(STAT_TALK_LOST);
+		break;
+	case 0xEE:
+		stats_bump(STAT_TALK_START);
+		break;
+	case 0xEF:
+		stats_bump(STAT_TALK_BYTE);
+		break;
+	case 0xDA:
+		stats_bump(STAT_LISTEN_TIMEOUT);
+		break;
+	case 0xDB:
+		stats_bump(STAT_LISTEN_START);
+		break;
+	case 0xDC:
+		stats_bump(STAT_LISTEN_SYNC);
+		break;
+	case 0xDD:
+		stats_bump(STAT_LISTEN_SHORT);
+		break;
+	case 0xC0:
+		stats_bump(STAT_RECOVER_SYNC);
+		break;
+	case 0xC4:
+		stats_bump(STAT_RECOVER_SPIKE);
+		break;
+	case 0xC8:
+		stats_bump(STAT_RECOVER_SRQ);
+		break;
+	}
+}
+
+#endif /* USE_STATS */
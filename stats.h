@@ -0,0 +1,82 @@
+/*
+ * Copyright 2016 saybur
+ * 
+ * This file is part of trabular.
+ * 
+ * trabular is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * trabular is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with trabular.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Event and error counters, built in with USE_STATS so production
+ * units can be watched without DEBUG_MODE taking over the serial link.
+ * 
+ * Each counter is 16 bits and sticks at 0xFFFF rather than wrapping.
+ * Most are bumped from interrupt context, so outside of it they are
+ * read through stats_read(), which cannot catch a counter halfway
+ * through a carry from its low byte.  They are read with QUERY 0x20 plus the counter number, and all
+ * cleared with QUERY 0x03, see handle_query().  The ADB error counters
+ * follow the DEBUG_MODE codes given against each.
+ */
+
+#pragma once
+
+#include "hal.h"
+
+#define STAT_SYNC 0 // 0xE0, attention or sync out of spec
+#define STAT_COMMAND 1 // 0xE4, command byte unreadable
+#define STAT_SRQ_ERROR 2 // 0xE8, line misbehaved around an SRQ
+#define STAT_TALK_BEATEN 3 // 0xEC, another device talked first
+#define STAT_TALK_LOST 4 // 0xED, lost the line during a reply
+#define STAT_TALK_START 5 // 0xEE, start bit of a reply failed
+#define STAT_TALK_BYTE 6 // 0xEF, reply byte failed
+#define STAT_LISTEN_TIMEOUT 7 // 0xDA, no data after a listen
+#define STAT_LISTEN_START 8 // 0xDB, listen start bit too long
+#define STAT_LISTEN_SYNC 9 // 0xDC, listen data never started
+#define STAT_LISTEN_SHORT 10 // 0xDD, listen with under 2 bytes
+#define STAT_COLLISIONS 11 // address collisions flagged
+#define STAT_SRQS 12 // service requests asserted
+#define STAT_TALKS 13 // replies sent in full
+#define STAT_LISTENS 14 // listens applied
+#define STAT_RESETS 15 // bus resets
+#define STAT_KEYS_DROPPED 16 // keys lost to a full keyboard buffer
+#define STAT_ARB_DROPPED 17 // arbitrary packets refused or lost
+#define STAT_DEFERS 18 // replies held back for a more urgent device
+#define STAT_RECOVER_SYNC 19 // 0xC0, sync out of spec but the command read
+#define STAT_RECOVER_SPIKE 20 // 0xC4, spike skipped in a command or listen
+#define STAT_RECOVER_SRQ 21 // 0xC8, too late for an SRQ, command served
+#define STATS 22
+
+#ifdef USE_STATS
+
+extern uint16_t stats[STATS];
+
+void stats_clear();
+uint16_t stats_read(uint8_t);
+void stats_code(uint8_t);
+
+static inline void stats_bump(uint8_t id) __attribute__((always_inline));
+static inline void stats_bump(uint8_t id)
+{
+	if (stats[id] != 0xFFFF) stats[id]++;
+}
+
+#define STATS_BUMP(id) stats_bump(id)
+#define STATS_CODE(c) stats_code(c)
+
+#else /* ! USE_STATS */
+
+#define STATS_BUMP(id) ((void) 0)
+#define STATS_CODE(c) ((void) 0)
+
+#endif /* USE_STATS */
@@ -18,42 +18,77 @@
  */
 
 #include "serial.h"
+#include "adb.h"
+#include "profile.h"
+#include "stats.h"
 
-#define BAUD 38400
-#include <util/setbaud.h>
+#ifdef HOST_BUILD
+	#include <stdio.h>
+#endif
 
 static void test_ring_buffer();
 static void test_sequential();
 static void test_keyboard();
+#if defined(USE_FRAMED) && defined(USE_KEYBOARD) && defined(USE_MOUSE)
+	static void test_framed();
+#endif
+#if defined(USE_ARB_TRANSPORT)
+	static void test_transport();
+#elif defined(USE_ARBITRARY)
+	static void test_arbitrary();
+#endif
+#ifdef HOST_BUILD
+	static void test_adb();
+	static void test_usart();
+	static void host_putchar(uint8_t);
+#endif
 
 static void report(uint8_t, uint8_t, uint16_t);
+static void expect(uint8_t, uint8_t, uint16_t);
 static uint8_t nibble_to_ascii(uint8_t);
 static void uart_send(uint8_t);
 
+// number of expect() calls that did not match
+static uint8_t failures = 0;
+
 /*
  * Test code for use on a Arduino.  Flash the unit with the code,
  * attach via the USB serial, adjust settings, then reset to see the
  * results in ASCII text.
+ * 
+ * This can also be built natively with "make host", in which case the
+ * results are written to stdout, the ADB handler is exercised against
+ * a scripted bus, and the exit status reports any failed checks.
  */
 int main()
 {
 	// setup UART for sending results
-	UBRR0H = UBRRH_VALUE;
-	UBRR0L = UBRRL_VALUE;
-	#if USE_2X
-		UCSR0A |= _BV(U2X0);
-	#else
-		UCSR0A &= ~(_BV(U2X0));
+	HAL_USART_INIT();
+	#ifdef HOST_BUILD
+		hal_host_usart_sink = host_putchar;
 	#endif
-	UCSR0B |= _BV(TXEN0);
 	
 	test_ring_buffer();
 	test_sequential();
 	test_keyboard();
+	#if defined(USE_FRAMED) && defined(USE_KEYBOARD) && defined(USE_MOUSE)
+		test_framed();
+	#endif
+	#if defined(USE_ARB_TRANSPORT)
+		test_transport();
+	#elif defined(USE_ARBITRARY)
+		test_arbitrary();
+	#endif
 	
-	// go into busy loop until reset
-	while (1);
-	return 0;
+	#ifdef HOST_BUILD
+		test_adb();
+		test_usart();
+		return failures > 0;
+	#else
+		// done until reset, which also ends a "make bench" run
+		HAL_HALT();
+		return 0;
+	#endif
 }
 
 /*
@@ -66,10 +101,10 @@ static void test_ring_buffer()
 	uart_send(nibble_to_ascii((RING_BUFFER_BITS & 0x0F)));
 	uart_send('\n');
 	
-	struct buffer buf = {};
+	struct buffer buf = { 0 };
 	ring_buffer_add_dual(&buf, 0x01, 0x02);
 	ring_buffer_add_dual(&buf, 0x03, 0x04);
-	report(1, 2, ring_buffer_peek(&buf));
+	expect(1, 2, ring_buffer_peek(&buf));
 	ring_buffer_add(&buf, 0x05);
 	ring_buffer_add_dual(&buf, 0x06, 0x07);
 	ring_buffer_add_dual(&buf, 0x08, 0x09);
@@ -77,45 +112,50 @@ static void test_ring_buffer()
 	ring_buffer_add_dual(&buf, 0x0C, 0x0D);
 	ring_buffer_add_dual(&buf, 0x0E, 0x0F);
 	ring_buffer_add_dual(&buf, 0x10, 0x11);
-	report(0x01, 0x02, ring_buffer_peek(&buf));
+	expect(0x01, 0x02, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x03, 0x04, ring_buffer_peek(&buf));
+	expect(0x03, 0x04, ring_buffer_peek(&buf));
 	ring_buffer_add_dual(&buf, 0x12, 0x13);
 	ring_buffer_add_dual(&buf, 0x14, 0x15);
-	report(0x03, 0x04, ring_buffer_peek(&buf));
+	expect(0x03, 0x04, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x05, 0x00, ring_buffer_peek(&buf));
+	expect(0x05, 0xFF, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x06, 0x07, ring_buffer_peek(&buf));
+	expect(0x06, 0x07, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x08, 0x09, ring_buffer_peek(&buf));
+	expect(0x08, 0x09, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x0A, 0x0B, ring_buffer_peek(&buf));
+	expect(0x0A, 0x0B, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x0C, 0x0D, ring_buffer_peek(&buf));
+	expect(0x0C, 0x0D, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x0E, 0x0F, ring_buffer_peek(&buf));
+	expect(0x0E, 0x0F, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x12, 0x13, ring_buffer_peek(&buf));
+	expect(0x12, 0x13, ring_buffer_peek(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0x00, 0x00, ring_buffer_peek(&buf));
-	report(0, 2, ring_buffer_size(&buf));
-	report(0, 0, ring_buffer_empty(&buf));
+	expect(0xFF, 0xFF, ring_buffer_peek(&buf));
+	expect(0, 0, ring_buffer_size(&buf));
+	expect(0, 1, ring_buffer_empty(&buf));
 	ring_buffer_drain(&buf, 2);
-	report(0, 0, ring_buffer_size(&buf));
-	report(0, 1, ring_buffer_empty(&buf));
+	expect(0, 0, ring_buffer_size(&buf));
+	expect(0, 1, ring_buffer_empty(&buf));
 	
 	ring_buffer_add_dual(&buf, 20, 21);
-	report(20, 21, ring_buffer_peek(&buf));
-	report(0, 2, ring_buffer_size(&buf));
-	report(0, 0, ring_buffer_empty(&buf));
+	expect(20, 21, ring_buffer_peek(&buf));
+	expect(0, 2, ring_buffer_size(&buf));
+	expect(0, 0, ring_buffer_empty(&buf));
 	ring_buffer_clear(&buf);
-	report(0, 0, ring_buffer_size(&buf));
-	report(0, 1, ring_buffer_empty(&buf));
+	expect(0, 0, ring_buffer_size(&buf));
+	expect(0, 1, ring_buffer_empty(&buf));
 }
 
 /*
- * Profile all input values into to the SPI system.
+ * Profile all input values into to the SPI system.  The times are in
+ * CPU cycles, and are what "make bench" checks (see bench.awk).
+ * 
+ * Commands that take more bytes are finished off after being timed,
+ * so the sweep stays in the nibble protocol, and the byte that
+ * finishes them is timed as well.
  */
 static void test_sequential()
 {
@@ -127,14 +167,47 @@ static void test_sequential()
 	for (i = 0; i <= 0xFF; i++)
 	{
 		// start timer @ prescale /1 and measure an operation
-		TCCR1B = 0x01;
+		HAL_TIMER1_START();
 		handle_serial_data(i);
-		TCCR1B = 0x00;
+		HAL_TIMER1_HALT();
 
 		// print the timing data and reset for the next run
-		report(0, i, TCNT1);
-		TCNT1 = 0;
+		report(0, i, HAL_TIMER1_READ());
+		HAL_TIMER1_CLEAR();
+		
+		uint8_t last;
+		if (i == 0x09) // MOUSE REPORT, no motion or buttons
+		{
+			handle_serial_data(0x00);
+			handle_serial_data(0x00);
+			last = 0x00;
+		}
+		else if (i == 0x0A) // QUERY, of a reserved value
+		{
+			last = 0xFF;
+		}
+		#ifdef USE_FRAMED
+		else if (i == 0x0B) // FRAMED MODE, left with a frame
+		{
+			handle_serial_data(0xF0);
+			last = 0x0F;
+		}
+		#endif
+		else
+		{
+			continue;
+		}
+		HAL_TIMER1_START();
+		handle_serial_data(last);
+		HAL_TIMER1_HALT();
+		report(2, i, HAL_TIMER1_READ());
+		HAL_TIMER1_CLEAR();
 	}
+	
+	// the sweep selected the last keyboard and mouse, go back to the
+	// first for the tests that follow
+	handle_serial_data(0x10);
+	handle_serial_data(0x18);
 }
 
 /*
@@ -154,18 +227,905 @@ static void test_keyboard()
 		
 		// then send high bits and check performance
 		nib = ((i & 0xF0) >> 4) + 0x50;
-		TCCR1B = 0x01;
+		HAL_TIMER1_START();
 		handle_serial_data(nib);
-		TCCR1B = 0x00;
+		HAL_TIMER1_HALT();
 
 		// print the timing data and reset for the next run
-		report(1, i, TCNT1);
-		TCNT1 = 0;
-		ring_buffer_clear(&kbd_buf);
-		ring_buffer_add(&kbd_buf, 0); // garbage to slow 7F/FF down
+		report(1, i, HAL_TIMER1_READ());
+		HAL_TIMER1_CLEAR();
+		ring_buffer_clear(&kbd_buf[0]);
+		ring_buffer_add(&kbd_buf[0], 0); // garbage to slow 7F/FF down
 	}
+	
+	// modifiers follow the keys into register 2
+	kbd_reg2_low[0] = 0;
+	kbd_reg2_high[0] = 0;
+	handle_serial_data(0x4A); // left option down
+	handle_serial_data(0x53);
+	handle_serial_data(0x41); // scroll lock down
+	handle_serial_data(0x57);
+	handle_serial_data(0x4F); // power down
+	handle_serial_data(0x57);
+	expect(_BV(KBD_REG2_OPT_BIT) | _BV(KBD_REG2_RST_BIT),
+			_BV(KBD_REG2_SCRL_BIT),
+			(kbd_reg2_high[0] << 8) + kbd_reg2_low[0]);
+	handle_serial_data(0x4A); // left option up
+	handle_serial_data(0x5B);
+	handle_serial_data(0x40); // a, not a modifier
+	handle_serial_data(0x50);
+	expect(_BV(KBD_REG2_RST_BIT), _BV(KBD_REG2_SCRL_BIT),
+			(kbd_reg2_high[0] << 8) + kbd_reg2_low[0]);
+	reset_registers();
 }
 
+#if defined(USE_FRAMED) && defined(USE_KEYBOARD) && defined(USE_MOUSE)
+/*
+ * Sends frames in the framed protocol, including one missing a byte
+ * that the frame after it must still get through, and single key
+ * bytes, then a packed mouse report in the nibble protocol.
+ */
+static void test_framed()
+{
+	uart_send(nibble_to_ascii(0x00));
+	uart_send(nibble_to_ascii(0x0D));
+	uart_send('\n');
+	
+	static const uint8_t frames[] = {
+		0x12, 0x30, 0x8C, // keys 0x30 and 0x31, missing the 0x31
+		0x12, 0x30, 0x31, 0x8C, // and again in full
+		0x23, 0xFD, 0x05, 0x80, 0x5A, // mouse -3, 5, button up
+	};
+	uint8_t i;
+	
+	reset_registers();
+	handle_serial_data(0x0B); // FRAMED MODE
+	for (i = 0; i < sizeof(frames); i++)
+	{
+		handle_serial_data(frames[i]);
+	}
+	expect(0, 2, ring_buffer_size(&kbd_buf[0]));
+	expect(0x30, 0x31, ring_buffer_peek(&kbd_buf[0]));
+	expect(0xFF, 0xFD, mse_x[0]);
+	expect(0, 5, mse_y[0]);
+	expect(0, 0x80, mse_btn_data[0]);
+	
+	// single keys between frames, but not when picking up after a
+	// broken one, whose 0x73 and 0x56 would be keys on their own
+	ring_buffer_clear(&kbd_buf[0]);
+	handle_serial_data(0x41);
+	handle_serial_data(0x99);
+	expect(0, 2, ring_buffer_size(&kbd_buf[0]));
+	expect(0x01, 0x81, ring_buffer_peek(&kbd_buf[0]));
+	static const uint8_t broken[] = {
+		0x23, 0x73, 0x56, 0x00, // mouse, missing a byte
+		0x11, 0x20, 0xCE, // key 0x20
+	};
+	for (i = 0; i < sizeof(broken); i++)
+	{
+		handle_serial_data(broken[i]);
+	}
+	expect(0, 3, ring_buffer_size(&kbd_buf[0]));
+	
+	// keycodes past the single key range, down then up, after the
+	// escape
+	ring_buffer_clear(&kbd_buf[0]);
+	handle_serial_data(0xF1);
+	handle_serial_data(0x7A);
+	handle_serial_data(0xF1);
+	handle_serial_data(0xFA);
+	expect(0, 2, ring_buffer_size(&kbd_buf[0]));
+	expect(0x7A, 0xFA, ring_buffer_peek(&kbd_buf[0]));
+	
+	// a frame cut short is dropped once input has gone idle, rather
+	// than taking the next key as its own
+	HAL_TIMER1_FREE_RUN();
+	handle_serial_data(0x12);
+	handle_serial_data(0x30);
+	uint16_t start = HAL_TIMER1_READ();
+	while ((uint16_t) (HAL_TIMER1_READ() - start) < 40000); // 20ms
+	handle_serial_data(0x42);
+	expect(0, 3, ring_buffer_size(&kbd_buf[0]));
+	
+	// a command frame ending in a QUERY, whose argument isn't taken
+	// from the next frame, then one clearing the keyboard, then back
+	// to nibbles
+	handle_serial_data(0x01);
+	handle_serial_data(0x0A);
+	handle_serial_data(0xF4);
+	handle_serial_data(0x01);
+	handle_serial_data(0x05);
+	handle_serial_data(0xF9);
+	expect(0, 0, ring_buffer_size(&kbd_buf[0]));
+	handle_serial_data(0xF0);
+	handle_serial_data(0x0F);
+	expect(0, 0x80, handle_serial_data(0x01)); // TALK STATUS
+	
+	// and the packed mouse report, which waits for all three bytes
+	handle_serial_data(0x09); // MOUSE REPORT
+	handle_serial_data(0x32);
+	handle_serial_data(0xCE);
+	expect(0xFF, 0xFD, mse_x[0]);
+	handle_serial_data(0x00);
+	expect(0, 0x2F, mse_x[0]);
+	expect(0xFF, 0xD3, mse_y[0]);
+	expect(0, 0, mse_btn_data[0]);
+	
+	reset_registers();
+}
+#endif
+
+#if defined(USE_ARBITRARY) && !defined(USE_ARB_TRANSPORT)
+/*
+ * Queues several register 0 packets and checks that talks send them
+ * in order, and that a full queue is reported in the status, then
+ * checks listens are passed back.
+ */
+static void test_arbitrary()
+{
+	uart_send(nibble_to_ascii(0x00));
+	uart_send(nibble_to_ascii(0x0E));
+	uart_send('\n');
+	
+	uint8_t xmit[8];
+	uint8_t i;
+	
+	reset_registers();
+	for (i = 0; i < ARB_QUEUE_SIZE + 1; i++)
+	{
+		// bytes i, 0xA5, then READY
+		handle_serial_data(0x20 + (i & 0x0F));
+		handle_serial_data(0x30 + (i >> 4));
+		handle_serial_data(0x25);
+		handle_serial_data(0x3A);
+		handle_serial_data(0x02);
+	}
+	expect(0, ARB_QUEUE_SIZE, arb_queue_count);
+	expect(0, 0x84, handle_serial_data(0x01)); // TALK STATUS
+	
+	for (i = 0; i < ARB_QUEUE_SIZE; i++)
+	{
+		expect(0, 2, arb_talk(0, xmit, 0));
+		expect(i, 0xA5, (xmit[0] << 8) + xmit[1]);
+		arb_talk_drain(0, 0);
+	}
+	expect(0, 0, arb_talk(0, xmit, 0));
+	
+	// the packet that didn't fit is still staged
+	handle_serial_data(0x02);
+	expect(0, 1, arb_queue_count);
+	
+	// listens come back whole, in order
+	static const uint8_t listen[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	arb_listen(0, 0, listen, 8);
+	arb_listen(0, 2, listen + 6, 2);
+	expect(0, 0x8A, handle_serial_data(0x01)); // TALK STATUS
+	expect(0, 0x08, arb_rx_pop(xmit));
+	expect(0x07, 0x08, (xmit[6] << 8) + xmit[7]);
+	expect(0, 0x22, arb_rx_pop(xmit));
+	expect(0x07, 0x08, (xmit[0] << 8) + xmit[1]);
+	expect(0, 0, arb_rx_pop(xmit));
+	
+	reset_registers();
+}
+#endif
+
+#ifdef USE_ARB_TRANSPORT
+/*
+ * Fills the window with sequenced packets, acknowledges part of it and
+ * checks the rest is sent again after idle polls, then checks that
+ * only in-sequence packets from the Mac are passed on.
+ */
+static void test_transport()
+{
+	uart_send(nibble_to_ascii(0x01));
+	uart_send(nibble_to_ascii(0x00));
+	uart_send('\n');
+	
+	uint8_t xmit[8];
+	uint8_t i;
+	
+	reset_registers();
+	for (i = 0; i < ARB_QUEUE_SIZE; i++)
+	{
+		arb_buf0[0] = i;
+		arb_buf0_len = 1;
+		expect(0, 1, arb_queue_push());
+	}
+	
+	// all of them go out without waiting, then nothing until resent
+	for (i = 0; i < ARB_QUEUE_SIZE; i++)
+	{
+		expect(0, 2, arb_talk(0, xmit, 0));
+		expect(i << 4, i, (xmit[0] << 8) + xmit[1]);
+		arb_talk_drain(0, 0);
+	}
+	expect(0, 0, arb_talk(0, xmit, 0));
+	
+	// acknowledging the first two leaves the others in flight
+	static const uint8_t ack[2] = { 0x02, 0x00 };
+	arb_listen(0, 1, ack, 2);
+	expect(0, 2, arb_queue_count);
+	expect(0, 2, arb_talk(0, xmit, 1));
+	expect(0x20, FIFO_BITS, (xmit[0] << 8) + xmit[1]);
+	
+	// after enough idle polls the unacknowledged ones are sent again
+	for (i = 1; i < ARB_RESEND_POLLS; i++)
+	{
+		expect(0, 0, arb_talk(0, xmit, 0));
+	}
+	expect(0, 2, arb_talk(0, xmit, 0));
+	expect(0x20, 0x02, (xmit[0] << 8) + xmit[1]);
+	arb_talk_drain(0, 0);
+	
+	// a header alone queues nothing, or it would read as empty
+	static const uint8_t bare[1] = { 0x00 };
+	arb_listen(0, 0, bare, 1);
+	expect(0, 0, fifo_count(&arb_rx));
+	
+	// only the next packet in sequence is taken, carrying an ack
+	static const uint8_t early[3] = { 0x14, 0xAB, 0xCD };
+	arb_listen(0, 0, early, 3);
+	expect(0, 0, fifo_count(&arb_rx));
+	static const uint8_t next[3] = { 0x04, 0xAB, 0xCD };
+	arb_listen(0, 0, next, 3);
+	arb_listen(0, 0, next, 3);
+	expect(0, 0, arb_queue_count);
+	expect(0, 0x02, arb_rx_pop(xmit));
+	expect(0xAB, 0xCD, (xmit[0] << 8) + xmit[1]);
+	expect(0, 0, arb_rx_pop(xmit));
+	
+	// a flush restarts the sequences but keeps queued data
+	arb_buf0[0] = 0x55;
+	arb_buf0_len = 1;
+	arb_queue_push();
+	arb_transport_reset();
+	expect(0, 2, arb_talk(0, xmit, 0));
+	expect(0x00, 0x55, (xmit[0] << 8) + xmit[1]);
+	
+	reset_registers();
+}
+#endif
+
+#ifdef HOST_BUILD
+
+// ADB timing used by the scripted bus master, in microseconds
+#define SCRIPT_ATTN 800
+#define SCRIPT_SYNC 70
+#define SCRIPT_BIT_SHORT 35
+#define SCRIPT_BIT_LONG 65
+#define SCRIPT_TLT 200
+#define SCRIPT_IDLE 1000
+#define SCRIPT_RESET 3000
+
+static struct hal_host_pulse script[96];
+static uint16_t script_len;
+static uint32_t script_us;
+static uint64_t device_edges[48];
+static uint8_t device_edge_count;
+
+static void script_add(uint8_t asserted, uint16_t us)
+{
+	script[script_len].asserted = asserted;
+	script[script_len].us = us;
+	script_len++;
+	script_us += us;
+}
+
+static void script_bit(uint8_t bit)
+{
+	script_add(1, bit ? SCRIPT_BIT_SHORT : SCRIPT_BIT_LONG);
+	script_add(0, bit ? SCRIPT_BIT_LONG : SCRIPT_BIT_SHORT);
+}
+
+static void script_byte(uint8_t v)
+{
+	uint8_t i;
+	for (i = 0; i < 8; i++)
+	{
+		script_bit(v & 0x80);
+		v <<= 1;
+	}
+}
+
+/*
+ * Starts a new transaction: attention, sync, the command byte, and the
+ * low part of the stop bit.  The caller adds the rest.
+ */
+static void script_command(uint8_t command)
+{
+	script_len = 0;
+	script_us = 0;
+	device_edge_count = 0;
+	script_add(0, SCRIPT_IDLE);
+	script_add(1, SCRIPT_ATTN);
+	script_add(0, SCRIPT_SYNC);
+	script_byte(command);
+	script_add(1, SCRIPT_BIT_LONG);
+}
+
+/*
+ * Puts a short spike in the middle of the given released part of the
+ * script, as noise on the bus would.
+ */
+static void script_spike(uint16_t at)
+{
+	uint16_t us = script[at].us;
+	uint16_t i;
+	for (i = script_len - 1; i > at; i--)
+	{
+		script[i + 2] = script[i];
+	}
+	script_len += 2;
+	script[at].us = us / 2 - 2;
+	script[at + 1].asserted = 1;
+	script[at + 1].us = 4;
+	script[at + 2].asserted = 0;
+	script[at + 2].us = us - us / 2 - 2;
+}
+
+static void script_listen_data(uint8_t high, uint8_t low)
+{
+	script_add(0, SCRIPT_TLT);
+	script_bit(1);
+	script_byte(high);
+	script_byte(low);
+	script_add(1, SCRIPT_BIT_LONG);
+}
+
+static void script_run()
+{
+	script_add(0, SCRIPT_IDLE);
+	hal_host_line_script(script, script_len);
+	hal_host_run(handle_adb, HAL_HOST_US(script_us));
+}
+
+#ifdef USE_MOUSE_SHAPING
+/*
+ * Lets the given number of Timer1 ticks go by.
+ */
+static void timer1_wait(uint16_t ticks)
+{
+	uint16_t start = HAL_TIMER1_READ();
+	while ((uint16_t) (HAL_TIMER1_READ() - start) < ticks);
+}
+#endif
+
+#ifdef USE_ADB_EVENTS
+static void idle_pass()
+{
+	HAL_IDLE();
+}
+
+/*
+ * As script_run(), but with a main loop that has fallen behind, so
+ * whatever the event engine's interrupts leave for it is left waiting.
+ */
+static void script_run_behind()
+{
+	script_add(0, SCRIPT_IDLE);
+	hal_host_line_script(script, script_len);
+	hal_host_run(idle_pass, HAL_HOST_US(script_us));
+}
+
+// mouse steps still to come from the serial side, and when the next is
+static uint8_t busy_steps;
+static uint64_t busy_next;
+
+static void busy_pass()
+{
+	if (busy_steps && hal_host_cycles >= busy_next)
+	{
+		handle_serial_data(0x81); // X +1
+		busy_steps--;
+		busy_next = hal_host_cycles + HAL_HOST_US(300);
+	}
+	handle_adb();
+}
+
+/*
+ * As script_run(), but with a main loop kept busy with serial input
+ * all the way through, so the interrupts land in the middle of it.
+ */
+static void script_run_busy()
+{
+	script_add(0, SCRIPT_IDLE);
+	hal_host_line_script(script, script_len);
+	hal_host_run(busy_pass, HAL_HOST_US(script_us));
+}
+#endif
+
+static void record_device_edge(uint64_t time, uint8_t asserted)
+{
+	(void) asserted;
+	if (device_edge_count < 48)
+	{
+		device_edges[device_edge_count++] = time;
+	}
+}
+
+/*
+ * Decodes the device's reply from the recorded edges, skipping the
+ * start bit and any SRQ before it.  Bits are decided on the asserted
+ * time of each cell.
+ */
+static uint16_t device_reply()
+{
+	uint16_t v = 0;
+	uint8_t first = 0;
+	uint8_t i;
+	if (device_edge_count >= 2
+			&& device_edges[1] - device_edges[0] > HAL_HOST_US(200))
+	{
+		first = 2;
+	}
+	for (i = first + 2; i + 1 < device_edge_count && i < first + 34;
+			i += 2)
+	{
+		uint64_t low = device_edges[i + 1] - device_edges[i];
+		v <<= 1;
+		if (low < HAL_HOST_US(50)) v |= 1;
+	}
+	return v;
+}
+
+/*
+ * Runs the ADB handler against scripted transactions, checking that
+ * listens update registers, talks produce the expected reply, and a
+ * reset restores the defaults.
+ */
+static void test_adb()
+{
+	uart_send(nibble_to_ascii(0x00));
+	uart_send(nibble_to_ascii(0x0B));
+	uart_send('\n');
+	
+	uint8_t xmit[8];
+	
+	hal_host_device_hook = record_device_edge;
+	adb_init();
+	adb_reset();
+	#ifdef USE_STATS
+		stats_clear();
+	#endif
+	
+	// a key is staged as a register 0 response between transactions,
+	// and a talk sends it from there
+	handle_serial_data(0x4A);
+	handle_serial_data(0x50);
+	expect(0, ADB_KBD_FLAG_MASK(0), device_stale & ADB_KBD_FLAG_MASK(0));
+	device_stage();
+	expect(0, 0, device_stale & ADB_KBD_FLAG_MASK(0));
+	expect(0, 2, device_staged_len[ADB_KBD_DEVICE]);
+	expect(0x0A, 0xFF, (device_staged[ADB_KBD_DEVICE][0] << 8)
+			+ device_staged[ADB_KBD_DEVICE][1]);
+	script_command(0x2C);
+	script_add(0, SCRIPT_TLT + 2000);
+	script_run();
+	expect(0x0A, 0xFF, device_reply());
+	expect(0, 0, ring_buffer_size(&kbd_buf[0]));
+	
+	// listen register 2 on the keyboard sets the LEDs
+	script_command(0x2A);
+	script_listen_data(0x00, 0x05);
+	script_run();
+	expect(0, 0xFD, kbd_reg2_low[0]);
+	
+	// talk register 3 on the mouse gives back address and handler
+	script_command(0x3F);
+	script_add(0, SCRIPT_TLT + 2000);
+	script_run();
+	expect(0, 36, device_edge_count);
+	expect(0x63, 0x01, device_reply());
+
+	// the generator behind that reply's delay reaches every nonzero state
+	uint16_t lfsr = 1;
+	uint16_t period = 0;
+	do
+	{
+		lfsr = adb_lfsr(lfsr);
+		period++;
+	} while (lfsr != 1);
+	expect(0xFF, 0xFF, period);
+
+	// listen register 3 on the keyboard moves it
+	script_command(0x2B);
+	script_listen_data(0x0A, 0x02);
+	script_run();
+	expect(0, 0x0A, kbd_addr[0]);
+	expect(0, ADB_KBD_FLAG_MASK(0), adb_map[0x0A]);
+	#if KBD_COUNT > 1
+		// which uncovers the next keyboard, for the host to find
+		expect(0, ADB_KBD_FLAG_MASK(1), adb_map[0x02]);
+		expect(0, 0x02, kbd_addr[1]);
+		
+		// keys go to whichever keyboard is selected, and each asks
+		// for service on its own
+		handle_serial_data(0x11); // SELECT KEYBOARD 1
+		handle_serial_data(0x4A);
+		handle_serial_data(0x50);
+		handle_serial_data(0x10); // SELECT KEYBOARD 0
+		expect(0, 0, ring_buffer_size(&kbd_buf[0]));
+		expect(0, 1, ring_buffer_size(&kbd_buf[1]));
+		expect(0, ADB_KBD_FLAG_MASK(1), device_srq);
+		device_flush(ADB_KBD_FLAG_MASK(1));
+		expect(0, 0, device_srq);
+	#else
+		expect(0, 0, adb_map[0x02]);
+	#endif
+	
+	// a mouse moved on top of it stays quiet there
+	mse_addr[0] = 0x0A;
+	device_map_update();
+	expect(0, ADB_KBD_FLAG_MASK(0), adb_map[0x0A]);
+	#if MSE_COUNT > 1
+		expect(0, ADB_MSE_FLAG_MASK(1), adb_map[0x03]);
+	#else
+		expect(0, 0, adb_map[0x03]);
+	#endif
+	mse_addr[0] = 0x03;
+	device_map_update();
+	expect(0, ADB_MSE_FLAG_MASK(0), adb_map[0x03]);
+	
+	// listen register 3 on the mouse selects the extended protocol,
+	// which reports a large move and all buttons in one go
+	script_command(0x3B);
+	script_listen_data(0x03, 0x04);
+	script_run();
+	expect(0, 0x04, mse_handler[0]);
+	mse_x[0] = 300;
+	mse_y[0] = -200;
+	mse_btn_data[0] = 0x0D;
+	expect(0, MSE_EXT_LEN, mse_talk(0, xmit, 0));
+	expect(0x38, 0xAC, (xmit[0] << 8) + xmit[1]);
+	expect(0x62, 0xF8, (xmit[2] << 8) + xmit[3]);
+	expect(0, 0xF8, xmit[4]);
+	mse_talk_drain(0, 0);
+	expect(0, 0, mse_x[0] | mse_y[0]);
+	expect(0, 8, mse_talk(0, xmit, 1));
+	expect(0, 0x08, xmit[7]);
+	
+	// and a reset puts it back
+	script_len = 0;
+	script_us = 0;
+	script_add(0, SCRIPT_IDLE);
+	script_add(1, SCRIPT_RESET);
+	script_run();
+	expect(0, 0x02, kbd_addr[0]);
+	expect(0, ADB_KBD_FLAG_MASK(0), adb_map[0x02]);
+	expect(0, 0xFF, kbd_reg2_low[0]);
+	expect(0, 0x01, mse_handler[0]);
+	
+	#ifdef USE_STATS
+		// the transactions above were all counted, and counters stick
+		// at their limit
+		expect(0, 3, stats[STAT_LISTENS]);
+		expect(0, 2, stats[STAT_TALKS]);
+		expect(0, 1, stats[STAT_RESETS]);
+		expect(0, 0, stats[STAT_SYNC]);
+		stats[STAT_SYNC] = 0xFFFE;
+		stats_code(0xE0);
+		stats_code(0xE0);
+		expect(0xFF, 0xFF, stats[STAT_SYNC]);
+		expect(0xFF, 0xFF, stats_read(STAT_SYNC));
+		stats_clear();
+	#endif
+	
+	#ifdef PROFILE
+		// every scripted talk and listen was timed, and taking a slot
+		// hands over its counts and starts it over
+		expect(0, 2, profile_slots[PROFILE_TALK].count);
+		{
+			struct profile p;
+			profile_take(PROFILE_LISTEN, &p);
+			expect(0, 3, p.count);
+			expect(0, 1, p.min <= p.max);
+			expect(0, 0, profile_slots[PROFILE_LISTEN].count);
+		}
+	#endif
+	
+	// a spike is skipped, whether it lands in a bit or would pass for
+	// the stop bit, and the transaction carries on
+	script_command(0x3F);
+	script_spike(6);
+	script_add(0, SCRIPT_TLT + 2000);
+	script_run();
+	expect(0x63, 0x01, device_reply());
+	script_command(0x3F);
+	script_spike(18);
+	script_add(0, SCRIPT_TLT + 2000);
+	script_run();
+	expect(0x63, 0x01, device_reply());
+	#ifdef USE_STATS
+		expect(0, 2, stats[STAT_RECOVER_SPIKE]);
+		expect(0, 0, stats[STAT_COMMAND] + stats[STAT_SRQ_ERROR]);
+		stats_clear();
+	#endif
+
+	#if defined(USE_ARBITRARY) && ! defined(USE_ARB_TRANSPORT)
+		// while keys wait, the arbitrary device is held back, raising
+		// no SRQ and not answering, until it has waited through
+		// SRQ_STARVE_LIMIT keyboard replies
+		handle_serial_data(0x21);
+		handle_serial_data(0x30);
+		handle_serial_data(0x25);
+		handle_serial_data(0x3A);
+		handle_serial_data(0x02);
+		uint8_t n;
+		for (n = 0; n < SRQ_STARVE_LIMIT; n++)
+		{
+			handle_serial_data(0x4A);
+			handle_serial_data(0x50);
+			expect(0, ADB_ARB_FLAG_MASK, device_defer);
+			expect(0, 0, device_srq & ADB_ARB_FLAG_MASK);
+			script_command(0x7C);
+			script_add(0, SCRIPT_TLT + 2000);
+			script_run();
+			// just the keyboard's SRQ
+			expect(0, 2, device_edge_count);
+			script_command(0x2C);
+			script_add(0, SCRIPT_TLT + 2000);
+			script_run();
+			expect(0x0A, 0xFF, device_reply());
+		}
+		expect(0, SRQ_STARVE_LIMIT, device_starve[ADB_ARB_DEVICE]);
+		handle_serial_data(0x4A);
+		handle_serial_data(0x50);
+		expect(0, 0, device_defer);
+		script_command(0x7C);
+		script_add(0, SCRIPT_TLT + 2000);
+		script_run();
+		expect(0x01, 0xA5, device_reply());
+		expect(0, 0, device_starve[ADB_ARB_DEVICE]);
+		device_flush(ADB_KBD_FLAG_MASK(0));
+		expect(0, 0, device_srq | device_defer);
+		#ifdef USE_STATS
+			expect(0, SRQ_STARVE_LIMIT, stats[STAT_DEFERS]);
+		#endif
+	#endif
+
+	// serial input while a report is on the bus is neither lost nor
+	// taken back by its drain
+	mse_move(0, 5, 0);
+	expect(0, 2, mse_talk(0, xmit, 0));
+	handle_serial_data(0x61); // button 1 down, mid-reply
+	handle_serial_data(0x70);
+	mse_move(0, 3, 0);
+	mse_talk_drain(0, 0);
+	expect(0, 3, mse_x[0]);
+	expect(0, 1, mse_srq(0));
+	expect(0, 2, mse_talk(0, xmit, 0));
+	expect(0x00, 0x83, (xmit[0] << 8) + xmit[1]);
+	handle_serial_data(0x07); // MOUSE CLEAR X MOTION
+	mse_move(0, 2, 0);
+	mse_talk_drain(0, 0);
+	expect(0, 2, mse_x[0]);
+	mse_clear(0, MSE_CLEAR_BTN | MSE_CLEAR_X);
+	mse_talk(0, xmit, 0);
+	mse_talk_drain(0, 0);
+	expect(0, 0, mse_srq(0));
+	reset_mse_data(0);
+	handle_serial_data(0x4A);
+	handle_serial_data(0x50);
+	expect(0, 2, kbd_talk(0, xmit, 0));
+	handle_serial_data(0x05); // KEYBOARD CLEAR REGISTER 0
+	handle_serial_data(0x4B);
+	handle_serial_data(0x50);
+	kbd_talk_drain(0, 0);
+	expect(0x0B, 0xFF, ring_buffer_peek(&kbd_buf[0]));
+	kbd_clear(0);
+
+	#ifdef USE_ADB_EVENTS
+		// until the main loop gets to a reply's drain, the copy that
+		// went out is neither rebuilt nor sent again
+		mse_move(0, 5, 0);
+		while (device_stale & ADB_STAGED_MASK) device_stage();
+		script_command(0x3C);
+		script_add(0, SCRIPT_TLT + 2000);
+		script_run_behind();
+		expect(0x80, 0x85, device_reply());
+		mse_move(0, 3, 0);
+		device_stage();
+		expect(0x80, 0x85, (device_staged[ADB_MSE_DEVICE][0] << 8)
+				+ device_staged[ADB_MSE_DEVICE][1]);
+		script_command(0x3C);
+		script_add(0, SCRIPT_TLT + 2000);
+		script_run_behind();
+		expect(0, 0, device_edge_count);
+		script_command(0x3C);
+		script_add(0, SCRIPT_TLT + 2000);
+		script_run();
+		expect(0x80, 0x83, device_reply());
+		expect(0, 0, mse_x[0]);
+		
+		// and changes left by transactions in a row are all made, in
+		// order, each with its own data
+		script_command(0x2A);
+		script_listen_data(0x00, 0x05);
+		script_run_behind();
+		script_command(0x3B);
+		script_listen_data(0x03, 0x04);
+		script_run_behind();
+		expect(0, 0xFF, kbd_reg2_low[0]);
+		handle_adb();
+		expect(0, 0xFD, kbd_reg2_low[0]);
+		expect(0, 0x04, mse_handler[0]);
+		adb_reset();
+		
+		// talks are answered while the main loop is in the middle of
+		// its work, and a reply built before the latest steps drains
+		// just the ones it held
+		uint8_t k;
+		uint8_t moved = 0;
+		busy_steps = 100;
+		busy_next = 0;
+		for (k = 0; k < 6; k++)
+		{
+			script_command(k & 1 ? 0x3F : 0x3C);
+			script_add(0, SCRIPT_TLT + 2000);
+			script_run_busy();
+			if (k & 1)
+			{
+				expect(0x63, 0x01, device_reply());
+			}
+			else
+			{
+				expect(0, 0x80, device_reply() >> 8);
+				moved += device_reply() & 0x7F;
+			}
+		}
+		expect(0, 0, busy_steps);
+		expect(0, 100, moved + mse_x[0]);
+		reset_mse_data(0);
+	#endif
+	
+	#ifdef USE_MOUSE_SHAPING
+		// before the host's poll rate is known, a big diagonal move
+		// goes out as fast as it can, each axis clamped on its own
+		uint16_t sent[4];
+		uint8_t i;
+		mse_move(0, 200, -50);
+		expect(0, 4, mse_backlog(0));
+		for (i = 0; i < 4; i++)
+		{
+			mse_talk(0, xmit, 0);
+			mse_talk_drain(0, 0);
+			sent[i] = (xmit[0] << 8) + xmit[1];
+			timer1_wait(200);
+		}
+		expect(0xCE, 0xBF, sent[0]);
+		expect(0x80, 0xBF, sent[1]);
+		expect(0x80, 0xBF, sent[2]);
+		expect(0x80, 0x8B, sent[3]);
+		expect(0, 0, mse_backlog(0));
+		expect(0, 0, mse_backlog_age(0));
+		expect(0, 1, mse_poll_interval[0] >= 200
+				&& mse_poll_interval[0] < 300);
+		
+		// polled that fast, all of the next one is out well within a
+		// frame, so it keeps its direction, in full steps along X
+		mse_move(0, 200, -50);
+		for (i = 0; i < 4; i++)
+		{
+			mse_talk(0, xmit, 0);
+			mse_talk_drain(0, 0);
+			sent[i] = (xmit[0] << 8) + xmit[1];
+		}
+		expect(0xF1, 0xBF, sent[0]);
+		expect(0xF0, 0xBF, sent[1]);
+		expect(0xF0, 0xBF, sent[2]);
+		expect(0xFD, 0x8B, sent[3]);
+		
+		// but polled slowly, the rest is still sent as fast as it can
+		reset_mse_data(0);
+		mse_move(0, 200, -150);
+		for (i = 0; i < 4; i++)
+		{
+			mse_talk(0, xmit, 0);
+			mse_talk_drain(0, 0);
+			sent[i] = (xmit[0] << 8) + xmit[1];
+			timer1_wait(24000);
+		}
+		expect(0xC0, 0xBF, sent[1]);
+		expect(0xEA, 0xBF, sent[2]);
+		expect(0x80, 0x8B, sent[3]);
+		expect(0, 1, mse_poll_interval[0] >= 24000
+				&& mse_poll_interval[0] < 24100);
+		
+		// and the age of waiting motion counts up, saturating
+		mse_move(0, 1, 0);
+		timer1_wait(20000);
+		mse_age_update(0);
+		timer1_wait(20000);
+		mse_age_update(0);
+		expect(0x7F, 0xFF, mse_backlog_age(0));
+		reset_mse_data(0);
+		
+		// and a move needing more reports than the count can show is
+		// still sent a step at a time
+		mse_move(0, 24000, 0);
+		expect(0, 0xFF, mse_backlog(0));
+		mse_talk(0, xmit, 0);
+		mse_talk_drain(0, 0);
+		expect(0x80, 0xBF, (xmit[0] << 8) + xmit[1]);
+		expect(0x5D, 0x81, mse_x[0]);
+		reset_mse_data(0);
+	#endif
+	
+	hal_host_device_hook = 0;
+}
+
+/*
+ * Checks that replies sent back-to-back over the USART all make it
+ * out, instead of overwriting each other.
+ */
+static void test_usart()
+{
+	uint8_t reply[12];
+	uint8_t len = 0;
+	
+	uart_send(nibble_to_ascii(0x00));
+	uart_send(nibble_to_ascii(0x0C));
+	uart_send('\n');
+	
+	// collect the replies instead of printing them
+	while (! HAL_USART_TX_READY());
+	hal_host_usart_sink = 0;
+	init_data();
+	hal_host_usart_push(0x01); // TALK STATUS
+	hal_host_usart_push(0x01);
+	hal_host_usart_push(0x0A); // QUERY
+	hal_host_usart_push(0x00); // transmit queue depth
+	#ifdef USE_STATS
+		hal_host_usart_push(0x0A); // QUERY
+		hal_host_usart_push(0x20); // first counter
+	#endif
+	hal_host_line_script(0, 0);
+	hal_host_run(handle_adb, HAL_HOST_US(5000));
+	while (len < 8 && hal_host_usart_pop(&reply[len])) len++;
+	hal_host_usart_sink = host_putchar;
+	
+	// (DEBUG_MODE would mix its codes in with the replies)
+	#ifndef DEBUG_MODE
+		// each query reply is two more bytes, all of which get out
+		// whether or not they are queued
+		uint8_t want = 2;
+		#ifdef USE_USART_TX_IRQ
+			want += 2;
+		#endif
+		#ifdef USE_STATS
+			want += 2;
+		#endif
+		expect(0, want, len);
+		expect(0x80, 0x80, (reply[0] << 8) + reply[1]);
+	#endif
+	
+	#if defined(USE_ARBITRARY) && ! defined(USE_ARB_TRANSPORT) \
+			&& ! defined(DEBUG_MODE)
+		// and so does a long one
+		static const uint8_t listen[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+		arb_listen(0, 0, listen, 8);
+		while (! HAL_USART_TX_READY());
+		hal_host_usart_sink = 0;
+		hal_host_usart_push(0x0A); // QUERY
+		hal_host_usart_push(0x01); // arbitrary receive
+		hal_host_run(handle_adb, HAL_HOST_US(5000));
+		len = 0;
+		while (len < 12 && hal_host_usart_pop(&reply[len])) len++;
+		hal_host_usart_sink = host_putchar;
+		expect(0, 9, len);
+		expect(0x08, 0x08, (reply[0] << 8) + reply[8]);
+	#endif
+	expect(0, 0, hal_host_usart_overwrites);
+}
+
+static void host_putchar(uint8_t c)
+{
+	putchar(c);
+}
+
+#endif /* HOST_BUILD */
+
 static void report(uint8_t p, uint8_t i, uint16_t v)
 {
 	uart_send(nibble_to_ascii((p & 0xF0) >> 4));
@@ -181,10 +1141,25 @@ static void report(uint8_t p, uint8_t i, uint16_t v)
 	uart_send('\n');
 }
 
+/*
+ * As report(), but the first two values are the expected result, and
+ * a mismatch is flagged with a trailing '!' and counted.
+ */
+static void expect(uint8_t p, uint8_t i, uint16_t v)
+{
+	report(p, i, v);
+	if (v != (uint16_t) ((p << 8) + i))
+	{
+		uart_send('!');
+		uart_send('\n');
+		if (failures < 0xFF) failures++;
+	}
+}
+
 static void uart_send(uint8_t c)
 {
-	loop_until_bit_is_set(UCSR0A, UDRE0);
-	UDR0 = c;
+	while (! HAL_USART_TX_READY());
+	HAL_USART_WRITE(c);
 }
 
 static uint8_t nibble_to_ascii(uint8_t v)